@@ -0,0 +1,8 @@
+# Generates a C++ header holding the kernel source as a string, so the executable does not read kernels.cl at runtime.
+# Each line becomes its own raw string literal, which keeps every literal under the compiler's length limit.
+# Usage: embed_kernels.ps1 <kernels.cl> <output header>
+param([string]$Source, [string]$Output)
+
+$lines = Get-Content -LiteralPath $Source | ForEach-Object { 'R"CLC(' + $_ + ')CLC" "\n"' }
+$header = @('// Generated from kernels.cl by embed_kernels.ps1 at build time. Do not edit.', 'const char KERNEL_SOURCE[] =') + $lines + ';'
+Set-Content -LiteralPath $Output -Value $header -Encoding ASCII
@@ -1,46 +1,456 @@
+// The kernels are compiled once per pixel type: the host passes -DPIXEL_TYPE=uchar -DVECTOR_WIDTH=16 for 8-bit images
+// and -DPIXEL_TYPE=ushort -DVECTOR_WIDTH=8 for 16-bit images, so that a vector of pixels is always 16 bytes wide.
+#ifndef PIXEL_TYPE
+#define PIXEL_TYPE uchar
+#define VECTOR_WIDTH 16
+#endif
+#define CONCATENATE_(a, b) a##b
+#define CONCATENATE(a, b) CONCATENATE_(a, b)
+typedef PIXEL_TYPE pixel;
+typedef CONCATENATE(PIXEL_TYPE, 3) pixel3;
+typedef CONCATENATE(PIXEL_TYPE, 4) pixel4;
+#define vload_pixels CONCATENATE(vload, VECTOR_WIDTH)
+#define vstore_pixels CONCATENATE(vstore, VECTOR_WIDTH)
+
+// image_data[3] holds the layout of the image buffer. CImg stores images planar, with each channel in its own
+// contiguous plane, while interleaved buffers store all channels of a pixel next to each other (RGBRGB...).
+#define LAYOUT_PLANAR 0
+#define LAYOUT_INTERLEAVED 1
+
 // 1. Create histograms containing image intensities for each of the 3 colour channels.
 // The output array is comprised of 3 contiguous intensity histograms
-kernel void create_intensity_histogram(global const uchar* input, global int* output, global int* image_data) {
+kernel void create_intensity_histogram(global const pixel* input, global int* output, global int* image_data) {
 	const int BIT_DEPTH = image_data[0];
 	const int CHANNEL_COUNT = image_data[1];
 	const int GID = get_global_id(0);
 	const int PIXEL_COUNT = get_global_size(0);
+	const int PIXEL_STRIDE = (image_data[3] == LAYOUT_INTERLEAVED) ? CHANNEL_COUNT : 1;
+	const int CHANNEL_STRIDE = (image_data[3] == LAYOUT_INTERLEAVED) ? 1 : PIXEL_COUNT;
 	for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
-		int intensity = input[GID + (PIXEL_COUNT * channel)];
+		int intensity = input[(GID * PIXEL_STRIDE) + (CHANNEL_STRIDE * channel)];
 		atomic_inc(&output[intensity + (BIT_DEPTH * channel)]);
 	}
 }
 
-// 2. Creates a cumulative histogram from a non-cumulative histogram by employing a Hillis-Steele scan
-// NOTE: Is "cumulate" even a verb? Too bad!
-kernel void cumulate_histogram(global int* input, global int* output, global int* channel_count) {
-	int GID = get_global_id(0);
-	int BIN_COUNT = get_global_size(0);
-	global int* swap_buffer;
-	for (int stride = 1; stride <= BIN_COUNT; stride *= 2) {
-		for (int channel = 0; channel < channel_count[0]; channel++) {
-			output[GID + (BIN_COUNT * channel)] = input[GID + (BIN_COUNT * channel)];
-			if (GID >= stride)
-				output[GID + (BIN_COUNT * channel)] += input[GID + (BIN_COUNT * channel) - stride];
+// 1a. Work-group privatised version of (1). Each work group builds its own sub-histograms in local memory, then merges
+// them into the global histograms once per group, so the contended atomics stay inside the work group.
+// The kernel is thread-coarsened: each work-item walks many pixels with a grid-stride loop, so the host can size the
+// NDRange from the device's compute units instead of launching one tiny work-item per pixel. This means the global
+// size is unrelated to the image, so the pixel count is passed in explicitly.
+kernel void create_intensity_histogram_local(global const pixel* input, global int* output, local int* local_histogram, global int* image_data) {
+	const int BIN_COUNT = image_data[0];
+	const int CHANNEL_COUNT = image_data[1];
+	const int PIXEL_COUNT = image_data[2];
+	const int HISTOGRAM_SIZE = BIN_COUNT * CHANNEL_COUNT;
+	const int GID = get_global_id(0);
+	const int GLOBAL_SIZE = get_global_size(0);
+	const int LID = get_local_id(0);
+	const int LOCAL_SIZE = get_local_size(0);
+
+	for (int bin = LID; bin < HISTOGRAM_SIZE; bin += LOCAL_SIZE)
+		local_histogram[bin] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int index = GID; index < PIXEL_COUNT; index += GLOBAL_SIZE) {
+		for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+			int intensity = input[index + (PIXEL_COUNT * channel)];
+			atomic_inc(&local_histogram[intensity + (BIN_COUNT * channel)]);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int bin = LID; bin < HISTOGRAM_SIZE; bin += LOCAL_SIZE) {
+		if (local_histogram[bin] != 0) // Empty bins are common in low-contrast images and need no global traffic
+			atomic_add(&output[bin], local_histogram[bin]);
+	}
+}
+
+// 1b. First level of the hierarchical histogram, for bin counts too large to privatise whole. Dimension 1 of the NDRange
+// enumerates (channel, bin range) pairs, and each work group builds a local histogram of only its bin range over a
+// grid-strided share of the pixels. Every group writes its partial histogram to its own slice of partials, so no
+// global atomics are needed, and reduce_partial_histograms then sums the slices. Both image layouts are supported.
+kernel void create_intensity_histogram_partial(global const pixel* input, global int* partials, local int* local_histogram, global int* image_data, const int range_size) {
+	const int BIN_COUNT = image_data[0];
+	const int CHANNEL_COUNT = image_data[1];
+	const int PIXEL_COUNT = image_data[2];
+	const int RANGE_COUNT = (BIN_COUNT + range_size - 1) / range_size;
+	const int CHANNEL = get_global_id(1) / RANGE_COUNT;
+	const int RANGE_START = (get_global_id(1) % RANGE_COUNT) * range_size;
+	const int RANGE_LENGTH = min(range_size, BIN_COUNT - RANGE_START);
+	const int PIXEL_STRIDE = (image_data[3] == LAYOUT_INTERLEAVED) ? CHANNEL_COUNT : 1;
+	const int CHANNEL_STRIDE = (image_data[3] == LAYOUT_INTERLEAVED) ? 1 : PIXEL_COUNT;
+	const int LID = get_local_id(0);
+	const int LOCAL_SIZE = get_local_size(0);
+
+	for (int bin = LID; bin < RANGE_LENGTH; bin += LOCAL_SIZE)
+		local_histogram[bin] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	global const pixel* channel_input = input + (CHANNEL_STRIDE * CHANNEL);
+	for (int index = get_global_id(0); index < PIXEL_COUNT; index += get_global_size(0)) {
+		int bin = channel_input[index * PIXEL_STRIDE] - RANGE_START;
+		if (bin >= 0 && bin < RANGE_LENGTH)
+			atomic_inc(&local_histogram[bin]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	global int* partial = partials + (BIN_COUNT * CHANNEL_COUNT * get_group_id(0)) + (BIN_COUNT * CHANNEL) + RANGE_START;
+	for (int bin = LID; bin < RANGE_LENGTH; bin += LOCAL_SIZE)
+		partial[bin] = local_histogram[bin];
+}
+
+// 1c. Second level of the hierarchical histogram. One work-item per bin of every channel sums that bin across all of
+// the partial histograms, reading neighbouring bins from neighbouring work-items. The sums are added to the output, like
+// the atomics of the other histogram kernels, so the histograms of an image's tiles accumulate.
+kernel void reduce_partial_histograms(global const int* partials, global int* output, const int partial_count) {
+	const int GID = get_global_id(0);
+	const int HISTOGRAM_SIZE = get_global_size(0);
+	int total = 0;
+	for (int partial = 0; partial < partial_count; partial++)
+		total += partials[GID + (HISTOGRAM_SIZE * partial)];
+	output[GID] += total;
+}
+
+// 1d. 2D version of (1) for multi-channel images. Dimension 0 of the NDRange selects the pixel and dimension 1 the
+// channel, so the channels are counted in parallel instead of in a loop inside each work-item.
+kernel void create_intensity_histogram_2d(global const pixel* input, global int* output, global int* image_data) {
+	const int BIN_COUNT = image_data[0];
+	const int GID = get_global_id(0);
+	const int PIXEL_COUNT = get_global_size(0);
+	const int CHANNEL = get_global_id(1);
+	atomic_inc(&output[input[GID + (PIXEL_COUNT * CHANNEL)] + (BIN_COUNT * CHANNEL)]);
+}
+
+// 1e. 2D version of (1a) for multi-channel images. Dimension 1 of the NDRange selects the channel, so each work group
+// privatises a single channel's histogram, which also lets much larger bin counts fit in local memory.
+kernel void create_intensity_histogram_local_2d(global const pixel* input, global int* output, local int* local_histogram, global int* image_data) {
+	const int BIN_COUNT = image_data[0];
+	const int PIXEL_COUNT = image_data[2];
+	const int CHANNEL = get_global_id(1);
+	const int GID = get_global_id(0);
+	const int GLOBAL_SIZE = get_global_size(0);
+	const int LID = get_local_id(0);
+	const int LOCAL_SIZE = get_local_size(0);
+
+	for (int bin = LID; bin < BIN_COUNT; bin += LOCAL_SIZE)
+		local_histogram[bin] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	global const pixel* channel_input = input + (PIXEL_COUNT * CHANNEL);
+	for (int index = GID; index < PIXEL_COUNT; index += GLOBAL_SIZE)
+		atomic_inc(&local_histogram[channel_input[index]]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	global int* channel_output = output + (BIN_COUNT * CHANNEL);
+	for (int bin = LID; bin < BIN_COUNT; bin += LOCAL_SIZE) {
+		if (local_histogram[bin] != 0)
+			atomic_add(&channel_output[bin], local_histogram[bin]);
+	}
+}
+
+// 1f. Interleaved-layout version of (1a). RGB and RGBA pixels are fetched with a single pixel3 or pixel4 load, and any
+// other channel count falls back to one load per channel.
+kernel void create_intensity_histogram_local_interleaved(global const pixel* input, global int* output, local int* local_histogram, global int* image_data) {
+	const int BIN_COUNT = image_data[0];
+	const int CHANNEL_COUNT = image_data[1];
+	const int PIXEL_COUNT = image_data[2];
+	const int HISTOGRAM_SIZE = BIN_COUNT * CHANNEL_COUNT;
+	const int GID = get_global_id(0);
+	const int GLOBAL_SIZE = get_global_size(0);
+	const int LID = get_local_id(0);
+	const int LOCAL_SIZE = get_local_size(0);
+
+	for (int bin = LID; bin < HISTOGRAM_SIZE; bin += LOCAL_SIZE)
+		local_histogram[bin] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int index = GID; index < PIXEL_COUNT; index += GLOBAL_SIZE) {
+		if (CHANNEL_COUNT == 3) {
+			pixel3 intensity = vload3(index, input);
+			atomic_inc(&local_histogram[intensity.x]);
+			atomic_inc(&local_histogram[intensity.y + BIN_COUNT]);
+			atomic_inc(&local_histogram[intensity.z + (BIN_COUNT * 2)]);
+		}
+		else if (CHANNEL_COUNT == 4) {
+			pixel4 intensity = vload4(index, input);
+			atomic_inc(&local_histogram[intensity.x]);
+			atomic_inc(&local_histogram[intensity.y + BIN_COUNT]);
+			atomic_inc(&local_histogram[intensity.z + (BIN_COUNT * 2)]);
+			atomic_inc(&local_histogram[intensity.w + (BIN_COUNT * 3)]);
 		}
+		else {
+			for (int channel = 0; channel < CHANNEL_COUNT; channel++)
+				atomic_inc(&local_histogram[input[(index * CHANNEL_COUNT) + channel] + (BIN_COUNT * channel)]);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-		barrier(CLK_GLOBAL_MEM_FENCE);
+	for (int bin = LID; bin < HISTOGRAM_SIZE; bin += LOCAL_SIZE) {
+		if (local_histogram[bin] != 0)
+			atomic_add(&output[bin], local_histogram[bin]);
+	}
+}
 
-		swap_buffer = input;
-		input = output;
-		output = swap_buffer;
+// 2. Creates cumulative histograms from non-cumulative histograms by employing a work-efficient Blelloch scan.
+// NOTE: Is "cumulate" even a verb? Too bad!
+// The scan runs in local memory over a block of 2 * local size bins, so the local size must be a power of two.
+// An up-sweep builds a tree of partial sums, a down-sweep turns it into an exclusive scan, and each bin then adds
+// its own count back on to make the result inclusive. Dimension 1 of the NDRange selects the colour channel.
+void blelloch_scan(local int* scratch, const int LID, const int BLOCK_SIZE) {
+	int offset = 1;
+	for (int active = BLOCK_SIZE >> 1; active > 0; active >>= 1) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (LID < active)
+			scratch[offset * (2 * LID + 2) - 1] += scratch[offset * (2 * LID + 1) - 1];
+		offset <<= 1;
 	}
+
+	if (LID == 0)
+		scratch[BLOCK_SIZE - 1] = 0;
+
+	for (int active = 1; active < BLOCK_SIZE; active <<= 1) {
+		offset >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (LID < active) {
+			int left = offset * (2 * LID + 1) - 1;
+			int right = offset * (2 * LID + 2) - 1;
+			int swap = scratch[left];
+			scratch[left] = scratch[right];
+			scratch[right] += swap;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// 2a. Single work group per channel. Used when a whole histogram fits in one block.
+kernel void cumulate_histogram(global const int* input, global int* output, local int* scratch, const int bin_count) {
+	const int LID = get_local_id(0);
+	const int LOCAL_SIZE = get_local_size(0);
+	const int OFFSET = bin_count * get_global_id(1);
+
+	// Each work-item loads two bins half a block apart so neighbouring work-items touch neighbouring bins
+	int low = (LID < bin_count) ? input[OFFSET + LID] : 0;
+	int high = (LID + LOCAL_SIZE < bin_count) ? input[OFFSET + LID + LOCAL_SIZE] : 0;
+	scratch[LID] = low;
+	scratch[LID + LOCAL_SIZE] = high;
+
+	blelloch_scan(scratch, LID, LOCAL_SIZE * 2);
+
+	if (LID < bin_count)
+		output[OFFSET + LID] = scratch[LID] + low;
+	if (LID + LOCAL_SIZE < bin_count)
+		output[OFFSET + LID + LOCAL_SIZE] = scratch[LID + LOCAL_SIZE] + high;
+}
+
+// 2b. Multi-block scan for histograms larger than one block. Each work group scans its own block and writes the block
+// total to block_sums, laid out as one row of get_num_groups(0) totals per channel. Once the block sums have been
+// scanned themselves, propagate_block_sums adds each block's offset back on.
+kernel void cumulate_histogram_blocks(global const int* input, global int* output, global int* block_sums, local int* scratch, const int bin_count) {
+	const int LID = get_local_id(0);
+	const int LOCAL_SIZE = get_local_size(0);
+	const int BLOCK = get_group_id(0);
+	const int BLOCK_COUNT = get_num_groups(0);
+	const int CHANNEL = get_global_id(1);
+	const int OFFSET = bin_count * CHANNEL;
+	const int LOW_BIN = BLOCK * LOCAL_SIZE * 2 + LID;
+	const int HIGH_BIN = LOW_BIN + LOCAL_SIZE;
+
+	int low = (LOW_BIN < bin_count) ? input[OFFSET + LOW_BIN] : 0;
+	int high = (HIGH_BIN < bin_count) ? input[OFFSET + HIGH_BIN] : 0;
+	scratch[LID] = low;
+	scratch[LID + LOCAL_SIZE] = high;
+
+	blelloch_scan(scratch, LID, LOCAL_SIZE * 2);
+
+	if (LOW_BIN < bin_count)
+		output[OFFSET + LOW_BIN] = scratch[LID] + low;
+	if (HIGH_BIN < bin_count)
+		output[OFFSET + HIGH_BIN] = scratch[LID + LOCAL_SIZE] + high;
+	if (LID == LOCAL_SIZE - 1)
+		block_sums[BLOCK_COUNT * CHANNEL + BLOCK] = scratch[LID + LOCAL_SIZE] + high;
+}
+
+// 2c. Adds the inclusive scan of the preceding blocks' totals to every bin of each block after the first
+kernel void propagate_block_sums(global int* output, global const int* scanned_block_sums, const int bin_count, const int block_size, const int block_count) {
+	const int BIN = get_global_id(0);
+	const int CHANNEL = get_global_id(1);
+	const int BLOCK = BIN / block_size;
+	if (BIN < bin_count && BLOCK > 0)
+		output[bin_count * CHANNEL + BIN] += scanned_block_sums[block_count * CHANNEL + BLOCK - 1];
+}
+
+// 3. Normalize cumulative histograms into per-channel lookup tables, with one work-item per bin and dimension 1 of the
+// NDRange selecting the channel. The maths is done in 64-bit integers, so the table is exact and the map stage is
+// left with nothing but a lookup. Each table is normalised by its channel's total, the last cumulative count, which is
+// the pixel count for a histogram of one image but need not be for a smoothed one, so the top bin always maps to the
+// top intensity.
+kernel void build_lookup_table(global const int* cumulative_histogram, global pixel* lut, global int* image_data) {
+	const int BIN_COUNT = image_data[0];
+	const int BIN = get_global_id(0) + (BIN_COUNT * get_global_id(1));
+	const int TOTAL = max(cumulative_histogram[(BIN_COUNT * (get_global_id(1) + 1)) - 1], 1);
+	lut[BIN] = (pixel)(((ulong)cumulative_histogram[BIN] * (BIN_COUNT - 1)) / TOTAL);
 }
 
-// 3. Normalize cumulative histogram
 // 4. Map image pixels to CDF intensities
-kernel void map_cumulative_histogram_to_image(global const uchar* input_image, global const int* histogram, global uchar* output_image, global int* image_data) {
-	const int BIT_DEPTH = image_data[0];
+kernel void map_lookup_table_to_image(global const pixel* input_image, global const pixel* lut, global pixel* output_image, global int* image_data) {
+	const int BIN_COUNT = image_data[0];
 	const int CHANNEL_COUNT = image_data[1];
 	const int GID = get_global_id(0);
 	const int PIXEL_COUNT = get_global_size(0);
-	for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
-		int value = (int)(((float)histogram[input_image[GID + (PIXEL_COUNT * channel)]] / (float)PIXEL_COUNT) * (BIT_DEPTH-1)); // Prepare for... unforeseen consequencessss...
-		output_image[GID + (PIXEL_COUNT * channel)] = value;
+	for (int channel = 0; channel < CHANNEL_COUNT; channel++)
+		output_image[GID + (PIXEL_COUNT * channel)] = lut[input_image[GID + (PIXEL_COUNT * channel)] + (BIN_COUNT * channel)];
+}
+
+// 4a. Vectorised version of (4). Each work group first stages its channel's lookup table in local memory, then each
+// work-item maps VECTOR_WIDTH consecutive pixels of that channel (a uchar16 or ushort8) with a single vector load and
+// store. Dimension 1 of the NDRange selects the channel, and the last work-item of a channel maps any leftover pixels
+// one at a time.
+kernel void map_lookup_table_to_image_vector(global const pixel* input_image, global const pixel* global_lut, global pixel* output_image, local pixel* lut, global int* image_data) {
+	const int BIN_COUNT = image_data[0];
+	const int PIXEL_COUNT = image_data[2];
+	const int CHANNEL = get_global_id(1);
+	const int GID = get_global_id(0);
+	const int LID = get_local_id(0);
+	const int LOCAL_SIZE = get_local_size(0);
+
+	for (int bin = LID; bin < BIN_COUNT; bin += LOCAL_SIZE)
+		lut[bin] = global_lut[bin + (BIN_COUNT * CHANNEL)];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	global const pixel* input = input_image + (PIXEL_COUNT * CHANNEL);
+	global pixel* output = output_image + (PIXEL_COUNT * CHANNEL);
+	if ((GID + 1) * VECTOR_WIDTH <= PIXEL_COUNT) {
+		pixel pixels[VECTOR_WIDTH];
+		vstore_pixels(vload_pixels(GID, input), 0, pixels);
+		for (int i = 0; i < VECTOR_WIDTH; i++)
+			pixels[i] = lut[pixels[i]];
+		vstore_pixels(vload_pixels(0, pixels), GID, output);
+	}
+	else {
+		for (int index = GID * VECTOR_WIDTH; index < PIXEL_COUNT; index++)
+			output[index] = lut[input[index]];
+	}
+}
+
+// 4b. 2D version of (4) for multi-channel images, with dimension 1 of the NDRange selecting the channel
+kernel void map_lookup_table_to_image_2d(global const pixel* input_image, global const pixel* lut, global pixel* output_image, global int* image_data) {
+	const int BIN_COUNT = image_data[0];
+	const int GID = get_global_id(0);
+	const int PIXEL_COUNT = get_global_size(0);
+	const int CHANNEL = get_global_id(1);
+	output_image[GID + (PIXEL_COUNT * CHANNEL)] = lut[input_image[GID + (PIXEL_COUNT * CHANNEL)] + (BIN_COUNT * CHANNEL)];
+}
+
+// 4c. Interleaved-layout version of (4). Each work-item maps one whole pixel, with a single pixel3 or pixel4 load and
+// store for RGB and RGBA images, and writes it back in the same interleaved layout.
+kernel void map_lookup_table_to_image_interleaved(global const pixel* input_image, global const pixel* lut, global pixel* output_image, global int* image_data) {
+	const int BIN_COUNT = image_data[0];
+	const int CHANNEL_COUNT = image_data[1];
+	const int GID = get_global_id(0);
+	if (CHANNEL_COUNT == 3) {
+		pixel3 intensity = vload3(GID, input_image);
+		vstore3((pixel3)(lut[intensity.x], lut[intensity.y + BIN_COUNT], lut[intensity.z + (BIN_COUNT * 2)]), GID, output_image);
+	}
+	else if (CHANNEL_COUNT == 4) {
+		pixel4 intensity = vload4(GID, input_image);
+		vstore4((pixel4)(lut[intensity.x], lut[intensity.y + BIN_COUNT], lut[intensity.z + (BIN_COUNT * 2)], lut[intensity.w + (BIN_COUNT * 3)]), GID, output_image);
+	}
+	else {
+		for (int channel = 0; channel < CHANNEL_COUNT; channel++)
+			output_image[(GID * CHANNEL_COUNT) + channel] = lut[input_image[(GID * CHANNEL_COUNT) + channel] + (BIN_COUNT * channel)];
+	}
+}
+
+// 5. Batched versions of the pipeline for many small images, which are packed one after another into a single buffer
+// so that each stage takes one launch for the whole batch. The images are planar, so every channel of every image is
+// a contiguous run of pixels with its own histogram, called a segment. segments[s] holds (first pixel, pixel count,
+// first bin, bin count) of segment s, and dimension 1 of every NDRange selects the segment.
+
+// 5a. Batched version of (1a). One work group privatises each segment's histogram and, being the only group on that
+// segment, writes it out directly, so neither global atomics nor a zeroed histogram buffer are needed.
+kernel void create_intensity_histogram_batched(global const pixel* input, global int* output, local int* local_histogram, global const int4* segments) {
+	const int4 SEGMENT = segments[get_global_id(1)];
+	const int LID = get_local_id(0);
+	const int LOCAL_SIZE = get_local_size(0);
+
+	for (int bin = LID; bin < SEGMENT.w; bin += LOCAL_SIZE)
+		local_histogram[bin] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int index = LID; index < SEGMENT.y; index += LOCAL_SIZE)
+		atomic_inc(&local_histogram[input[SEGMENT.x + index]]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int bin = LID; bin < SEGMENT.w; bin += LOCAL_SIZE)
+		output[SEGMENT.z + bin] = local_histogram[bin];
+}
+
+// 5b. Batched version of (2a). One work group scans each segment's histogram a block at a time, carrying the running
+// total from block to block. The total of a block is its exclusive scan's last entry plus that bin's own count.
+kernel void cumulate_histogram_batched(global const int* input, global int* output, local int* scratch, global const int4* segments) {
+	const int4 SEGMENT = segments[get_global_id(1)];
+	const int LID = get_local_id(0);
+	const int LOCAL_SIZE = get_local_size(0);
+	const int BLOCK_SIZE = LOCAL_SIZE * 2;
+
+	int carry = 0;
+	for (int block = 0; block < SEGMENT.w; block += BLOCK_SIZE) {
+		const int LOW_BIN = block + LID;
+		const int HIGH_BIN = LOW_BIN + LOCAL_SIZE;
+		const int LAST_BIN = block + BLOCK_SIZE - 1;
+		int low = (LOW_BIN < SEGMENT.w) ? input[SEGMENT.z + LOW_BIN] : 0;
+		int high = (HIGH_BIN < SEGMENT.w) ? input[SEGMENT.z + HIGH_BIN] : 0;
+		scratch[LID] = low;
+		scratch[LID + LOCAL_SIZE] = high;
+
+		blelloch_scan(scratch, LID, BLOCK_SIZE);
+
+		if (LOW_BIN < SEGMENT.w)
+			output[SEGMENT.z + LOW_BIN] = carry + scratch[LID] + low;
+		if (HIGH_BIN < SEGMENT.w)
+			output[SEGMENT.z + HIGH_BIN] = carry + scratch[LID + LOCAL_SIZE] + high;
+		carry += scratch[BLOCK_SIZE - 1] + ((LAST_BIN < SEGMENT.w) ? input[SEGMENT.z + LAST_BIN] : 0);
+		barrier(CLK_LOCAL_MEM_FENCE); // Every work-item must have read the scratch before the next block overwrites it
 	}
-}
\ No newline at end of file
+}
+
+// 5c. Batched version of (3). Dimension 0 covers the largest bin count in the batch, so segments with fewer bins
+// leave the excess work-items idle.
+kernel void build_lookup_table_batched(global const int* cumulative_histogram, global pixel* lut, global const int4* segments) {
+	const int4 SEGMENT = segments[get_global_id(1)];
+	const int BIN = get_global_id(0);
+	if (BIN < SEGMENT.w)
+		lut[SEGMENT.z + BIN] = (pixel)(((ulong)cumulative_histogram[SEGMENT.z + BIN] * (SEGMENT.w - 1)) / SEGMENT.y);
+}
+
+// 5d. Batched version of (4). Work-items stride over their segment, so dimension 0 need not match any one image.
+kernel void map_lookup_table_to_image_batched(global const pixel* input_image, global const pixel* lut, global pixel* output_image, global const int4* segments) {
+	const int4 SEGMENT = segments[get_global_id(1)];
+	for (int index = get_global_id(0); index < SEGMENT.y; index += get_global_size(0))
+		output_image[SEGMENT.x + index] = lut[SEGMENT.z + input_image[SEGMENT.x + index]];
+}
+
+// 6. Prepares the raw payload of a binary PNM image in place, before the histogram, so the host can upload a
+// memory-mapped file without touching its pixels. 16-bit samples are converted from big-endian, as stored in the file,
+// and samples above the header's maximum value, which would index past the histogram and lookup table, are clamped to it.
+kernel void prepare_samples(global pixel* image, const int max_value) {
+	const int GID = get_global_id(0);
+	pixel value = image[GID];
+	if (sizeof(pixel) > 1)
+		value = (pixel)((value << 8) | (value >> 8));
+	image[GID] = min(value, (pixel)max_value);
+}
+
+// 7. Temporal smoothing for image sequences. Blends the histogram of the current frame, as fractions of its pixel
+// count, into a running exponential moving average with weight alpha, starting the average afresh when alpha is 1.
+// The average is written back over the histogram as counts for the scan, rounded to nearest. Their total may then
+// differ from the pixel count a little, which the lookup table allows for by normalising by the total.
+kernel void smooth_histogram(global int* histogram, global float* smoothed_histogram, global int* image_data, const float alpha) {
+	const int GID = get_global_id(0);
+	const int PIXEL_COUNT = image_data[2];
+	float average = (float)histogram[GID] / PIXEL_COUNT;
+	if (alpha < 1.0f)
+		average = (alpha * average) + ((1.0f - alpha) * smoothed_histogram[GID]);
+	smoothed_histogram[GID] = average;
+	histogram[GID] = (int)((average * PIXEL_COUNT) + 0.5f);
+}
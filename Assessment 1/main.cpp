@@ -1,9 +1,26 @@
 #pragma once
 #include <iostream>
 #include <vector>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <cctype>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// Headless builds (-DHEADLESS, or the Headless|x64 configuration) compile CImg without display support, so they need
+// neither X11 nor GDI and must save their results with -o
+#ifdef HEADLESS
+#define cimg_display 0
+#endif
 
 #include "Utils.h"
-#include "CImg.h"
+#include "CImg.h" // Also brings in windows.h and io.h, or unistd.h and sys/stat.h, which PnmFile and stream mode use
+#include "kernels.cl.h" // KERNEL_SOURCE, generated from kernels/kernels.cl at build time
 
 using namespace cimg_library;
 
@@ -14,176 +31,1852 @@ void print_help() {
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
 	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
+	std::cerr << "  -m : pipeline mode: staged, fused, compare, tiled or mapped to run fused on a memory-mapped P5/P6 file (default: staged)" << std::endl;
+	std::cerr << "  -t : tiled mode: maximum tile size in MB (default: from the device's memory limits)" << std::endl;
+	std::cerr << "  -c : pixels per work-item in the histogram kernel (default: one work group per compute unit)" << std::endl;
+	std::cerr << "  -i : process the image as an interleaved (RGBRGB...) frame" << std::endl;
+	std::cerr << "  -b : batch mode: equalise every PNM image in a directory, or listed one per line in a file" << std::endl;
+	std::cerr << "  -o : save the equalised image to this PNM file and open no windows, or in batch mode, the output directory (required by headless builds)" << std::endl;
+	std::cerr << "  -k : batch mode: pack this many small images into each kernel launch (default: 1)" << std::endl;
+	std::cerr << "  --kernels : build the kernels from this file instead of the source embedded at build time" << std::endl;
+	std::cerr << "  -s : stream mode: equalise binary PNM frames from standard input to standard output, logging to standard error" << std::endl;
+	std::cerr << "  -a : stream mode: treat the frames as a sequence, mapping each with the previous frames' lookup table and blending its histogram into theirs with this weight (0-1]" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
-vector<int> create_intensity_histogram(cl::Program& program, cl::Context& context, cl::CommandQueue& queue, cimg_library::CImg<unsigned char> from) {
-	int BIN_COUNT = from.max();
-
-	// 1. Create buffers and load image to device memory
-	cl::Buffer input_buffer(context, CL_MEM_READ_ONLY, from.size());
-	cl::Buffer output_buffer(context, CL_MEM_READ_WRITE, BIN_COUNT * from.spectrum() * sizeof(int)); // Multiply by channels because we create one histogram for each colour channel
-	cl::Buffer image_data_buffer(context, CL_MEM_READ_WRITE, sizeof(int) * 2);
-	cl::Event input_event;
-	queue.enqueueWriteBuffer(input_buffer, CL_TRUE, 0, from.size(), from.data(), NULL, &input_event);
-	vector<int> image_data{ from.max(), from.spectrum() };
-	queue.enqueueWriteBuffer(image_data_buffer, CL_TRUE, 0, sizeof(int) * image_data.size(), image_data.data());
-
-	// 2. Load and execute kernel
-	cl::Kernel kernel = cl::Kernel(program, "create_intensity_histogram");
-	kernel.setArg(0, input_buffer);
-	kernel.setArg(1, output_buffer);
-	kernel.setArg(2, image_data_buffer);
-	cl::NDRange NDrange{ from.size() / from.spectrum() }; // Divide by number of channels to prevent repeat operations
-	cl::Event kernel_event;
-	queue.enqueueNDRangeKernel(kernel, cl::NullRange, NDrange, cl::NullRange, NULL, &kernel_event);
-
-	// 3. Retrieve output from device memory
-	vector<int> histogram(BIN_COUNT * from.spectrum()); // Multiply by 3 because we create one histogram for each colour channel
-	cl::Event output_event;
-	queue.enqueueReadBuffer(output_buffer, CL_TRUE, 0, BIN_COUNT * from.spectrum() * sizeof(int), histogram.data(), NULL, &output_event);
-
-	// 4. Return result
-	cout << "[ CREATE INTENSITY HISTOGRAM ]" << endl;
-	cout << "Load image buffer: " << GetFullProfilingInfo(input_event, PROF_US) << endl;
-	cout << "Generate intensity histogram: " << GetFullProfilingInfo(kernel_event, PROF_US) << endl;
-	cout << "Retrieve histogram : " << GetFullProfilingInfo(output_event, PROF_US) << endl;
+// Build options that specialise kernels.cl for one pixel type, keeping a vector of pixels 16 bytes wide
+template <typename T> string pixel_build_options();
+template <> string pixel_build_options<unsigned char>() { return "-DPIXEL_TYPE=uchar -DVECTOR_WIDTH=16"; }
+template <> string pixel_build_options<unsigned short>() { return "-DPIXEL_TYPE=ushort -DVECTOR_WIDTH=8"; }
+
+// Memory layout of an image's channels. CImg stores images planar. Interleaved frames (RGBRGB...) are held as
+// CImg(channels, width, height), which is the shape permute_axes("cxyz") produces and the shape of a shared CImg
+// wrapped around an interleaved frame buffer, so they can be processed without transposing them on the host.
+enum PixelLayout {
+	LAYOUT_PLANAR = 0,
+	LAYOUT_INTERLEAVED = 1
+};
+
+template <typename T>
+int channel_count(const CImg<T>& image, PixelLayout layout) {
+	return layout == LAYOUT_INTERLEAVED ? image.width() : image.spectrum();
+}
+
+// Kernels and device buffers shared by every launch of a program. Kernels are created on first use, and buffers are
+// looked up by role and only reallocated when a launch needs more than the largest size requested so far, so once the
+// largest image has been seen no kernel or buffer is created again. Commands capture kernel arguments when they are
+// enqueued, so a cached kernel can be relaunched with new arguments while earlier launches are still queued.
+// Kernels, buffers and wait lists are looked up by name without building a string, so a warm launch allocates nothing.
+class PipelineCache {
+public:
+	PipelineCache(cl::Context& context, const cl::Program& program)
+		: context_(context), program_(program), device_(context.getInfo<CL_CONTEXT_DEVICES>()[0]) {}
+
+	cl::Context& context() { return context_; }
+	cl::Device& device() { return device_; }
+
+	cl::Kernel& kernel(const char* name) {
+		auto found = kernels_.find(name);
+		if (found == kernels_.end())
+			found = kernels_.emplace(name, cl::Kernel(program_, name)).first;
+		return found->second;
+	}
+
+	// index keeps apart buffers of the same role, e.g. one per level of a recursion
+	cl::Buffer& buffer(const char* role, size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE, int index = 0) {
+		PooledBuffer& pooled = pooled_entry(buffers_, role, index);
+		if (pooled.size < size) {
+			pooled.buffer = cl::Buffer(context_, flags, size);
+			pooled.size = size;
+		}
+		return pooled.buffer;
+	}
+
+	// Event list for the dependencies of a launch, kept between launches so that refilling it reuses its storage. It
+	// holds whatever its last user left in it until the same role and index are requested again.
+	vector<cl::Event>& events(const char* role, int index = 0) {
+		return pooled_entry(event_lists_, role, index);
+	}
+
+	// Wait list holding only the given event
+	const vector<cl::Event>* wait_list(const char* role, const cl::Event& event, int index = 0) {
+		vector<cl::Event>& list = events(role, index);
+		list.assign(1, event);
+		return &list;
+	}
+
+private:
+	struct PooledBuffer {
+		cl::Buffer buffer;
+		size_t size = 0;
+	};
+
+	// Entries are nodes of maps, so references to them stay valid while entries of other roles or indices are added
+	template <typename Entry>
+	static Entry& pooled_entry(map<string, map<int, Entry>, less<>>& pool, const char* role, int index) {
+		auto found = pool.find(role);
+		if (found == pool.end())
+			found = pool.emplace(role, map<int, Entry>()).first;
+		return found->second[index];
+	}
+
+	cl::Context context_;
+	cl::Program program_;
+	cl::Device device_;
+	map<string, cl::Kernel, less<>> kernels_;
+	map<string, map<int, PooledBuffer>, less<>> buffers_;
+	map<string, map<int, vector<cl::Event>>, less<>> event_lists_;
+};
+
+// Enqueues the histogram kernels over an image that is already in device memory. The histogram buffer must be zeroed
+// beforehand, and image_data holds { bin count, channel count, pixel count, layout }. The strategy is chosen from the
+// device's local memory size: histograms that fit are privatised whole per work group, larger ones are built as partial
+// histograms over bin ranges and then reduced, and only devices with almost no local memory use global atomics.
+// pixels_per_item sets how many pixels each work-item of the privatised kernel walks. When it is 0 the NDRange is
+// sized to one work group per compute unit instead, which keeps CPU runtimes from scheduling millions of work-items.
+// Multi-channel planar images use 2D NDRanges of (pixel, channel), so the channels are processed in parallel and each
+// work group only privatises one channel's histogram. Interleaved images load all channels of a pixel at once instead.
+void enqueue_histogram(PipelineCache& cache, cl::CommandQueue& queue, cl::Buffer& image, cl::Buffer& histogram, cl::Buffer& image_data, int bin_count, int channels, int pixel_count, const vector<cl::Event>* wait_events, vector<cl::Event>& kernel_events, int pixels_per_item = 0, PixelLayout layout = LAYOUT_PLANAR) {
+	const int MIN_RANGE_SIZE = 256; // Below this, re-reading the image once per bin range costs more than the atomics save
+	const int HISTOGRAM_SIZE = bin_count * channels * sizeof(int);
+	const bool INTERLEAVED = layout == LAYOUT_INTERLEAVED;
+	const bool USE_2D = channels > 1 && !INTERLEAVED;
+	const int PRIVATE_HISTOGRAM_SIZE = USE_2D ? bin_count * sizeof(int) : HISTOGRAM_SIZE;
+	cl::Device& device = cache.device();
+	const cl_ulong LOCAL_MEMORY = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+	if ((cl_ulong)PRIVATE_HISTOGRAM_SIZE <= LOCAL_MEMORY) {
+		cl::Kernel& kernel = cache.kernel(INTERLEAVED ? "create_intensity_histogram_local_interleaved" : USE_2D ? "create_intensity_histogram_local_2d" : "create_intensity_histogram_local");
+		const size_t LOCAL_SIZE = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+		size_t group_count = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+		if (pixels_per_item > 0) {
+			const size_t ITEM_COUNT = (pixel_count + pixels_per_item - 1) / pixels_per_item;
+			group_count = (ITEM_COUNT + LOCAL_SIZE - 1) / LOCAL_SIZE; // Round up to a whole number of work groups
+		}
+		kernel.setArg(0, image);
+		kernel.setArg(1, histogram);
+		kernel.setArg(2, cl::Local(PRIVATE_HISTOGRAM_SIZE));
+		kernel.setArg(3, image_data);
+		kernel_events.emplace_back();
+		if (USE_2D)
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(group_count * LOCAL_SIZE, channels), cl::NDRange(LOCAL_SIZE, 1), wait_events, &kernel_events.back());
+		else
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(group_count * LOCAL_SIZE), cl::NDRange(LOCAL_SIZE), wait_events, &kernel_events.back());
+		return;
+	}
+
+	cl::Kernel& partial_kernel = cache.kernel("create_intensity_histogram_partial");
+	const int RANGE_SIZE = min<cl_ulong>(bin_count, (LOCAL_MEMORY - partial_kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device)) / sizeof(int));
+	if (RANGE_SIZE >= MIN_RANGE_SIZE) {
+		const int RANGE_COUNT = (bin_count + RANGE_SIZE - 1) / RANGE_SIZE;
+		const int PARTIAL_COUNT = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(); // Work groups per bin range
+		const size_t LOCAL_SIZE = partial_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+		cl::Buffer& partials = cache.buffer("partials", (size_t)HISTOGRAM_SIZE * PARTIAL_COUNT);
+
+		partial_kernel.setArg(0, image);
+		partial_kernel.setArg(1, partials);
+		partial_kernel.setArg(2, cl::Local(RANGE_SIZE * sizeof(int)));
+		partial_kernel.setArg(3, image_data);
+		partial_kernel.setArg(4, RANGE_SIZE);
+		kernel_events.emplace_back();
+		queue.enqueueNDRangeKernel(partial_kernel, cl::NullRange, cl::NDRange(PARTIAL_COUNT * LOCAL_SIZE, RANGE_COUNT * channels), cl::NDRange(LOCAL_SIZE, 1), wait_events, &kernel_events.back());
+
+		cl::Kernel& reduce_kernel = cache.kernel("reduce_partial_histograms");
+		reduce_kernel.setArg(0, partials);
+		reduce_kernel.setArg(1, histogram);
+		reduce_kernel.setArg(2, PARTIAL_COUNT);
+		const vector<cl::Event>* reduce_wait_events = cache.wait_list("reduce_partial_histograms", kernel_events.back());
+		kernel_events.emplace_back();
+		queue.enqueueNDRangeKernel(reduce_kernel, cl::NullRange, cl::NDRange(bin_count * channels), cl::NullRange, reduce_wait_events, &kernel_events.back());
+		return;
+	}
+
+	cl::Kernel& kernel = cache.kernel(USE_2D ? "create_intensity_histogram_2d" : "create_intensity_histogram");
+	kernel.setArg(0, image);
+	kernel.setArg(1, histogram);
+	kernel.setArg(2, image_data);
+	cl::NDRange NDrange = USE_2D ? cl::NDRange(pixel_count, channels) : cl::NDRange(pixel_count); // One work-item per pixel rather than per value to prevent repeat operations
+	kernel_events.emplace_back();
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, NDrange, cl::NullRange, wait_events, &kernel_events.back());
+}
+
+// Prints one profiling line per event under a stage heading. The staged pipeline only calls this once the host has
+// synchronised, since profiling info is not available until a command has completed.
+void print_profiling(const string& stage, const string& step, const vector<cl::Event>& events) {
+	cout << "[ " << stage << " ]" << endl;
+	for (const cl::Event& event : events)
+		cout << step << ": " << GetFullProfilingInfo(event, PROF_US) << endl;
+}
+
+cl_ulong event_duration(const cl::Event& event) {
+	return event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
+// Zero-copy transfers. On devices that share physical memory with the host (CPUs and most integrated GPUs), an
+// explicit write or read of an image is a memcpy within the same RAM. There, the image buffers are instead created over
+// host storage with CL_MEM_USE_HOST_PTR and the result is synchronised back with map/unmap. That costs no copy only
+// when the storage meets the device's base address alignment, which CImg's own allocations need not, so the images are
+// decoded and equalised straight into AlignedImage storage instead (see load_equalise_and_display).
+bool zero_copy_supported(cl::CommandQueue& queue) {
+	return queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+}
+
+size_t zero_copy_alignment(cl::CommandQueue& queue) {
+	const size_t ALIGNMENT = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8; // Reported in bits
+	return max(ALIGNMENT, sizeof(void*));
+}
+
+// Drivers fall back to a hidden copy for host storage that is not aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN
+bool zero_copy_aligned(cl::CommandQueue& queue, const void* host_ptr) {
+	return reinterpret_cast<size_t>(host_ptr) % zero_copy_alignment(queue) == 0;
+}
+
+// Image storage aligned for zero-copy on the queue's device, seen through a shared CImg so that CImg never reallocates
+// or frees it. The size is rounded up to a whole number of alignment units, as some drivers also require.
+template <typename T>
+class AlignedImage {
+public:
+	AlignedImage(cl::CommandQueue& queue, int width, int height, int depth, int spectrum) {
+		const size_t ALIGNMENT = zero_copy_alignment(queue);
+		const size_t SIZE = ((size_t)width * height * depth * spectrum * sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+#ifdef _WIN32
+		data_ = _aligned_malloc(SIZE, ALIGNMENT);
+#else
+		if (posix_memalign(&data_, ALIGNMENT, SIZE) != 0)
+			data_ = NULL;
+#endif
+		if (!data_)
+			throw CImgInstanceException("AlignedImage: cannot allocate %lu aligned bytes", (unsigned long)SIZE);
+		image_.assign(static_cast<T*>(data_), width, height, depth, spectrum, true);
+	}
+
+	AlignedImage(const AlignedImage&) = delete;
+	AlignedImage& operator=(const AlignedImage&) = delete;
 
+	~AlignedImage() {
+#ifdef _WIN32
+		_aligned_free(data_);
+#else
+		free(data_);
+#endif
+	}
+
+	CImg<T>& image() { return image_; }
+
+private:
+	void* data_;
+	CImg<T> image_;
+};
+
+// Times an explicit write of the image through a device buffer and its read-back into read_back, i.e. the transfers
+// zero-copy avoids
+template <typename T>
+cl_ulong copy_transfer_time(cl::Context& context, cl::CommandQueue& queue, const cimg_library::CImg<T>& image, cimg_library::CImg<T>& read_back) {
+	const size_t IMAGE_SIZE = image.size() * sizeof(T);
+	cl::Buffer buffer(context, CL_MEM_READ_WRITE, IMAGE_SIZE);
+	cl::Event write_event, read_event;
+	queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, IMAGE_SIZE, image.data(), NULL, &write_event);
+	queue.enqueueReadBuffer(buffer, CL_TRUE, 0, IMAGE_SIZE, read_back.data(), NULL, &read_event);
+	return event_duration(write_event) + event_duration(read_event);
+}
+
+// Enqueues uploads of an image and its { bin count, channel count, pixel count, layout } description to device memory.
+// These are the only host-to-device transfers of the staged pipeline: every later stage works on the returned buffers
+// in place. The writes do not block, so both image and image_data must outlive upload_events. With zero_copy set, the
+// buffer wraps the image's storage and only the description is written.
+template <typename T>
+cl::Buffer upload_image(PipelineCache& cache, cl::CommandQueue& queue, const cimg_library::CImg<T>& image, const vector<int>& image_data, cl::Buffer& image_data_buffer, vector<cl::Event>& upload_events, bool zero_copy = false) {
+	const size_t IMAGE_SIZE = image.size() * sizeof(T);
+
+	// 1. Create buffers and enqueue uploads
+	image_data_buffer = cache.buffer("image_data", sizeof(int) * image_data.size(), CL_MEM_READ_ONLY);
+	upload_events.resize(1);
+	queue.enqueueWriteBuffer(image_data_buffer, CL_FALSE, 0, sizeof(int) * image_data.size(), image_data.data(), NULL, &upload_events[0]);
+	if (zero_copy)
+		return cl::Buffer(cache.context(), CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, IMAGE_SIZE, const_cast<T*>(image.data())); // The kernels never write to it
+	cl::Buffer& image_buffer = cache.buffer("image", IMAGE_SIZE, CL_MEM_READ_ONLY);
+	upload_events.emplace_back();
+	queue.enqueueWriteBuffer(image_buffer, CL_FALSE, 0, IMAGE_SIZE, image.data(), NULL, &upload_events.back());
+
+	// 2. Return result
+	return image_buffer;
+}
+
+cl::Buffer create_intensity_histogram(PipelineCache& cache, cl::CommandQueue& queue, cl::Buffer& image, cl::Buffer& image_data, int bin_count, int channels, int pixel_count, const vector<cl::Event>* wait_events, vector<cl::Event>& kernel_events, int pixels_per_item = 0, PixelLayout layout = LAYOUT_PLANAR) {
+	const int HISTOGRAM_SIZE = bin_count * channels * sizeof(int); // Multiply by channels because we create one histogram for each colour channel
+
+	// 1. Create buffers. Kernels accumulate into the histogram, so it must start zeroed before they run
+	cl::Buffer& histogram = cache.buffer("histogram", HISTOGRAM_SIZE);
+	vector<cl::Event> histogram_wait_events = wait_events ? *wait_events : vector<cl::Event>();
+	histogram_wait_events.emplace_back();
+	queue.enqueueFillBuffer(histogram, 0, 0, HISTOGRAM_SIZE, NULL, &histogram_wait_events.back());
+
+	// 2. Enqueue kernels
+	enqueue_histogram(cache, queue, image, histogram, image_data, bin_count, channels, pixel_count, &histogram_wait_events, kernel_events, pixels_per_item, layout);
+
+	// 3. Return result, leaving it in device memory
 	return histogram;
 }
 
-vector<int> cumulate_histogram(cl::Program& program, cl::Context& context, cl::CommandQueue& queue, vector<int> histogram, int channels) {
-	const int BUFFER_SIZE = histogram.size() * sizeof(int);
-
-	// 1. Create buffers and load image to device memory
-	cl::Buffer input_buffer(context, CL_MEM_READ_WRITE, BUFFER_SIZE);
-	cl::Buffer output_buffer(context, CL_MEM_READ_WRITE, BUFFER_SIZE);
-	cl::Buffer channel_count_buffer(context, CL_MEM_READ_ONLY, sizeof(int));
-	cl::Event input_event;
-	queue.enqueueWriteBuffer(input_buffer, CL_TRUE, 0, BUFFER_SIZE, histogram.data(), NULL, &input_event);
-	std::vector<int> channel_count_vector{ channels };
-	queue.enqueueWriteBuffer(channel_count_buffer, CL_TRUE, 0, sizeof(int), channel_count_vector.data());
-
-	// 2. Load and execute kernel
-	cl::Kernel kernel = cl::Kernel(program, "cumulate_histogram");
-	kernel.setArg(0, input_buffer);
-	kernel.setArg(1, output_buffer);
-	kernel.setArg(2, channel_count_buffer);
-	cl::NDRange NDrange{ histogram.size() / channels }; // Divide by number of channels to prevent repeat operations
-	cl::Event kernel_event;
-	queue.enqueueNDRangeKernel(kernel, cl::NullRange, NDrange, cl::NullRange, NULL, &kernel_event);
-
-	// 3. Retrieve output from device memory
-	vector<int> cumulative_histogram(histogram.size());
-	cl::Event output_event;
-	queue.enqueueReadBuffer(output_buffer, CL_TRUE, 0, BUFFER_SIZE, cumulative_histogram.data(), NULL, &output_event);
-
-	// 4. Return result
-	cout << "[ CUMULATE HISTOGRAM ]" << endl;
-	cout << "Load histogram buffer: " << GetFullProfilingInfo(input_event, PROF_US) << endl;
-	cout << "Generate cumulative histogram: " << GetFullProfilingInfo(kernel_event, PROF_US) << endl;
-	cout << "Retrieve cumulative histogram : " << GetFullProfilingInfo(output_event, PROF_US) << endl;
+// Largest power-of-two work-group size that both the device and the given kernel support
+size_t scan_local_size(cl::Kernel& kernel, cl::Device& device) {
+	size_t max_size = min(device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(), kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	size_t local_size = 1;
+	while (local_size * 2 <= max_size)
+		local_size *= 2;
+	return local_size;
+}
+
+// Enqueues an inclusive scan of `channels` contiguous histograms of `bin_count` bins each. Histograms that fit in a
+// single block are scanned by one work group per channel; larger ones are scanned block by block, the block totals
+// are scanned recursively, and the totals are then propagated back into each block.
+// Each kernel waits on the one before it, and the first waits on wait_events. depth is the level of recursion, which
+// keeps the block sum buffers and wait lists of each level apart in the cache.
+void enqueue_scan(PipelineCache& cache, cl::CommandQueue& queue, cl::Buffer& input, cl::Buffer& output, int bin_count, int channels, const vector<cl::Event>* wait_events, vector<cl::Event>& kernel_events, int depth = 0) {
+	cl::Device& device = cache.device();
+	cl::Kernel& kernel = cache.kernel("cumulate_histogram");
+	size_t local_size = scan_local_size(kernel, device);
+
+	if (bin_count <= (int)local_size * 2) {
+		while (local_size > 1 && bin_count <= (int)local_size) // Shrink to the smallest block that still covers every bin
+			local_size /= 2;
+		kernel.setArg(0, input);
+		kernel.setArg(1, output);
+		kernel.setArg(2, cl::Local(local_size * 2 * sizeof(int)));
+		kernel.setArg(3, bin_count);
+		kernel_events.emplace_back();
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(local_size, channels), cl::NDRange(local_size, 1), wait_events, &kernel_events.back());
+		return;
+	}
+
+	cl::Kernel& block_kernel = cache.kernel("cumulate_histogram_blocks");
+	local_size = min(local_size, scan_local_size(block_kernel, device));
+	const int BLOCK_SIZE = local_size * 2;
+	const int BLOCK_COUNT = (bin_count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	cl::Buffer& block_sums = cache.buffer("block_sums", BLOCK_COUNT * channels * sizeof(int), CL_MEM_READ_WRITE, depth);
+	cl::Buffer& scanned_block_sums = cache.buffer("scanned_block_sums", BLOCK_COUNT * channels * sizeof(int), CL_MEM_READ_WRITE, depth);
+
+	block_kernel.setArg(0, input);
+	block_kernel.setArg(1, output);
+	block_kernel.setArg(2, block_sums);
+	block_kernel.setArg(3, cl::Local(BLOCK_SIZE * sizeof(int)));
+	block_kernel.setArg(4, bin_count);
+	kernel_events.emplace_back();
+	queue.enqueueNDRangeKernel(block_kernel, cl::NullRange, cl::NDRange(BLOCK_COUNT * local_size, channels), cl::NDRange(local_size, 1), wait_events, &kernel_events.back());
+
+	enqueue_scan(cache, queue, block_sums, scanned_block_sums, BLOCK_COUNT, channels, cache.wait_list("cumulate_histogram_blocks", kernel_events.back(), depth), kernel_events, depth + 1);
+
+	cl::Kernel& propagate_kernel = cache.kernel("propagate_block_sums");
+	propagate_kernel.setArg(0, output);
+	propagate_kernel.setArg(1, scanned_block_sums);
+	propagate_kernel.setArg(2, bin_count);
+	propagate_kernel.setArg(3, BLOCK_SIZE);
+	propagate_kernel.setArg(4, BLOCK_COUNT);
+	const vector<cl::Event>* propagate_wait_events = cache.wait_list("propagate_block_sums", kernel_events.back(), depth);
+	kernel_events.emplace_back();
+	queue.enqueueNDRangeKernel(propagate_kernel, cl::NullRange, cl::NDRange(bin_count, channels), cl::NullRange, propagate_wait_events, &kernel_events.back());
+}
+
+cl::Buffer cumulate_histogram(PipelineCache& cache, cl::CommandQueue& queue, cl::Buffer& histogram, int bin_count, int channels, const vector<cl::Event>* wait_events, vector<cl::Event>& kernel_events) {
+	// 1. Create buffers
+	cl::Buffer& cumulative_histogram = cache.buffer("cumulative_histogram", bin_count * channels * sizeof(int));
+
+	// 2. Enqueue kernels. The scan variant is picked from the bin count and the device's work-group size
+	enqueue_scan(cache, queue, histogram, cumulative_histogram, bin_count, channels, wait_events, kernel_events);
+
+	// 3. Return result, leaving it in device memory
 	return cumulative_histogram;
 }
 
-CImg<unsigned char> map_cumulative_histogram_to_image(cl::Program& program, cl::Context& context, cl::CommandQueue& queue, cimg_library::CImg<unsigned char> input_image, vector<int> cumulative_histogram) {
-	const int HISTOGRAM_SIZE = cumulative_histogram.size() * sizeof(int);
-
-	// 1. Create buffers and load image to device memory
-	cl::Buffer input_image_buffer(context, CL_MEM_READ_ONLY, input_image.size());
-	cl::Buffer input_histogram_buffer(context, CL_MEM_READ_ONLY, HISTOGRAM_SIZE);
-	cl::Buffer output_buffer(context, CL_MEM_READ_WRITE, input_image.size());
-	cl::Buffer image_data_buffer(context, CL_MEM_READ_ONLY, sizeof(int) * 2);
-	cl::Event input_image_event;
-	cl::Event input_histogram_event;
-	queue.enqueueWriteBuffer(input_image_buffer, CL_TRUE, 0, input_image.size(), input_image.data(), NULL, &input_image_event);
-	queue.enqueueWriteBuffer(input_histogram_buffer, CL_TRUE, 0, HISTOGRAM_SIZE, cumulative_histogram.data(), NULL, &input_histogram_event);
-	vector<int> image_data{ input_image.max(), input_image.spectrum() };
-	queue.enqueueWriteBuffer(image_data_buffer, CL_TRUE, 0, sizeof(int) * image_data.size(), image_data.data());
-
-	// 2. Load and execute kernel
-	cl::Kernel kernel = cl::Kernel(program, "map_cumulative_histogram_to_image");
-	kernel.setArg(0, input_image_buffer);
-	kernel.setArg(1, input_histogram_buffer);
-	kernel.setArg(2, output_buffer);
-	kernel.setArg(3, image_data_buffer);
-	cl::Event kernel_event;
-	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(input_image.size() / input_image.spectrum()), cl::NullRange, NULL, &kernel_event);
-
-	// 3. Retrieve output from device memory
-	vector<unsigned char> image(input_image.size());
-	cl::Event output_event;
-	queue.enqueueReadBuffer(output_buffer, CL_TRUE, 0, input_image.size(), image.data(), NULL, &output_event);
-	CImg<unsigned char> output_image(image.data(), input_image.width(), input_image.height(), input_image.depth(), input_image.spectrum());
-
-	// 4. Return result
-	cout << "[ MAP CUMULATIVE HISTOGRAM TO IMAGE ]" << endl;
-	cout << "Load image buffer: " << GetFullProfilingInfo(input_image_event, PROF_US) << endl;
-	cout << "Load histogram buffer: " << GetFullProfilingInfo(input_histogram_event, PROF_US) << endl;
-	cout << "Generate modified image: " << GetFullProfilingInfo(kernel_event, PROF_US) << endl;
-	cout << "Retrieve modified image : " << GetFullProfilingInfo(output_event, PROF_US) << endl;
-	return output_image;
+// Enqueues the lookup table kernel, one work-item per bin of every channel. image_data holds { bin count, channel count,
+// pixel count, layout }.
+void enqueue_lookup_table(PipelineCache& cache, cl::CommandQueue& queue, cl::Buffer& cumulative_histogram, cl::Buffer& lut, cl::Buffer& image_data, int bin_count, int channels, const vector<cl::Event>* wait_events, cl::Event& kernel_event) {
+	cl::Kernel& kernel = cache.kernel("build_lookup_table");
+	kernel.setArg(0, cumulative_histogram);
+	kernel.setArg(1, lut);
+	kernel.setArg(2, image_data);
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(bin_count, channels), cl::NullRange, wait_events, &kernel_event);
+}
+
+template <typename T>
+cl::Buffer build_lookup_table(PipelineCache& cache, cl::CommandQueue& queue, cl::Buffer& cumulative_histogram, cl::Buffer& image_data, int bin_count, int channels, const vector<cl::Event>* wait_events, cl::Event& kernel_event) {
+	// 1. Create buffers
+	cl::Buffer& lut = cache.buffer("lut", bin_count * channels * sizeof(T));
+
+	// 2. Enqueue kernel
+	enqueue_lookup_table(cache, queue, cumulative_histogram, lut, image_data, bin_count, channels, wait_events, kernel_event);
+
+	// 3. Return result, leaving it in device memory
+	return lut;
+}
+
+// Reads a lookup table left in device memory back to the host, so that it can be reused across images or exported
+template <typename T>
+vector<T> read_lookup_table(cl::CommandQueue& queue, cl::Buffer& lut, size_t entry_count) {
+	vector<T> table(entry_count);
+	if (!table.empty())
+		queue.enqueueReadBuffer(lut, CL_TRUE, 0, entry_count * sizeof(T), table.data());
+	return table;
+}
+
+// Enqueues the map kernel, writing the equalised image to output. image_data holds { bin count, channel count,
+// pixel count, layout }.
+// The vectorised kernel is used whenever one channel's lookup table fits in local memory. Otherwise multi-channel
+// images are mapped over a 2D NDRange of (pixel, channel). Interleaved images are mapped one whole pixel per work-item.
+template <typename T>
+void enqueue_map(PipelineCache& cache, cl::CommandQueue& queue, cl::Buffer& image, cl::Buffer& lut, cl::Buffer& output, cl::Buffer& image_data, int bin_count, int channels, int pixel_count, const vector<cl::Event>* wait_events, cl::Event& kernel_event, PixelLayout layout = LAYOUT_PLANAR) {
+	if (layout == LAYOUT_INTERLEAVED) {
+		cl::Kernel& kernel = cache.kernel("map_lookup_table_to_image_interleaved");
+		kernel.setArg(0, image);
+		kernel.setArg(1, lut);
+		kernel.setArg(2, output);
+		kernel.setArg(3, image_data);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(pixel_count), cl::NullRange, wait_events, &kernel_event);
+		return;
+	}
+
+	cl::Device& device = cache.device();
+	bool use_vector = (cl_ulong)bin_count * sizeof(T) <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	bool use_2d = channels > 1;
+	cl::Kernel& kernel = cache.kernel(use_vector ? "map_lookup_table_to_image_vector" : use_2d ? "map_lookup_table_to_image_2d" : "map_lookup_table_to_image");
+	kernel.setArg(0, image);
+	kernel.setArg(1, lut);
+	kernel.setArg(2, output);
+	if (use_vector) {
+		const size_t LOCAL_SIZE = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+		const size_t VECTOR_WIDTH = 16 / sizeof(T);
+		const size_t VECTOR_COUNT = (pixel_count + VECTOR_WIDTH - 1) / VECTOR_WIDTH;
+		const size_t GLOBAL_SIZE = ((VECTOR_COUNT + LOCAL_SIZE - 1) / LOCAL_SIZE) * LOCAL_SIZE;
+		kernel.setArg(3, cl::Local(bin_count * sizeof(T)));
+		kernel.setArg(4, image_data);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(GLOBAL_SIZE, channels), cl::NDRange(LOCAL_SIZE, 1), wait_events, &kernel_event);
+	}
+	else {
+		kernel.setArg(3, image_data);
+		cl::NDRange NDrange = use_2d ? cl::NDRange(pixel_count, channels) : cl::NDRange(pixel_count);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, NDrange, cl::NullRange, wait_events, &kernel_event);
+	}
+}
+
+// Maps the image through the lookup table and enqueues a read of the result straight into output_image, which must
+// already have the same dimensions as the input. This is the only device-to-host transfer of the staged pipeline; the
+// read does not block, so output_image is only valid once the last of output_events has completed. With zero_copy set,
+// the kernel writes into output_image's storage and the read is replaced by a map and unmap of it.
+template <typename T>
+void map_lookup_table_to_image(PipelineCache& cache, cl::CommandQueue& queue, cl::Buffer& image, cl::Buffer& lut, cl::Buffer& image_data, int bin_count, int channels, int pixel_count, CImg<T>& output_image, const vector<cl::Event>* wait_events, cl::Event& kernel_event, vector<cl::Event>& output_events, PixelLayout layout = LAYOUT_PLANAR, bool zero_copy = false) {
+	const size_t IMAGE_SIZE = output_image.size() * sizeof(T);
+
+	// 1. Create buffers
+	cl::Buffer output_buffer = zero_copy
+		? cl::Buffer(cache.context(), CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, IMAGE_SIZE, output_image.data())
+		: cache.buffer("output", IMAGE_SIZE);
+
+	// 2. Enqueue kernel
+	enqueue_map<T>(cache, queue, image, lut, output_buffer, image_data, bin_count, channels, pixel_count, wait_events, kernel_event, layout);
+
+	// 3. Enqueue retrieval of output from device memory
+	vector<cl::Event> output_wait_events{ kernel_event };
+	if (zero_copy) {
+		output_events.resize(2);
+		void* mapped = queue.enqueueMapBuffer(output_buffer, CL_FALSE, CL_MAP_READ, 0, IMAGE_SIZE, &output_wait_events, &output_events[0]);
+		vector<cl::Event> unmap_wait_events{ output_events[0] };
+		queue.enqueueUnmapMemObject(output_buffer, mapped, &unmap_wait_events, &output_events[1]);
+	}
+	else {
+		output_events.resize(1);
+		queue.enqueueReadBuffer(output_buffer, CL_FALSE, 0, IMAGE_SIZE, output_image.data(), &output_wait_events, &output_events[0]);
+	}
+}
+
+// Program binary cache. Compiling kernels.cl from source dominates start-up on CPU runtimes, so built binaries are
+// stored in the working directory under a key made from everything that affects the compiled code: the device name,
+// its driver version, the build options and the kernel source itself.
+uint64_t fnv1a_hash(const string& text) {
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : text) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+string program_cache_file(const cl::Device& device, const string& source, const string& options) {
+	const string KEY = device.getInfo<CL_DEVICE_NAME>() + "\n" + device.getInfo<CL_DRIVER_VERSION>() + "\n" + options + "\n" + to_string(fnv1a_hash(source));
+	stringstream file_name;
+	file_name << "kernels_" << hex << fnv1a_hash(KEY) << ".bin";
+	return file_name.str();
+}
+
+// Writes a program binary to the cache. Jobs sharing the cache may load it at any moment, so the binary is written to
+// a file of this process's own and renamed into place, which replaces any existing file atomically. Returns false if
+// the cache could not be written.
+bool save_program_cache(const string& cache_file, const vector<unsigned char>& binary) {
+#ifdef _WIN32
+	const string TEMPORARY_FILE = cache_file + "." + to_string(_getpid()) + ".tmp";
+#else
+	const string TEMPORARY_FILE = cache_file + "." + to_string(getpid()) + ".tmp";
+#endif
+	ofstream temporary_stream(TEMPORARY_FILE, ios::binary);
+	const bool WRITTEN = (bool)temporary_stream.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+	temporary_stream.close();
+#ifdef _WIN32
+	const bool RENAMED = WRITTEN && MoveFileExA(TEMPORARY_FILE.c_str(), cache_file.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	const bool RENAMED = WRITTEN && rename(TEMPORARY_FILE.c_str(), cache_file.c_str()) == 0;
+#endif
+	if (!RENAMED)
+		remove(TEMPORARY_FILE.c_str());
+	return RENAMED;
+}
+
+// Builds the kernel source, normally KERNEL_SOURCE, with the given options. The binary is cached on disk per device,
+// driver, options and source, so a warm start neither reads nor compiles any source.
+cl::Program build_program(cl::Context& context, const string& source, const string& options) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	const string CACHE_FILE = program_cache_file(device, source, options);
+
+	// 1. Load the binary from the cache if there is one. A binary the driver rejects falls through to a source build
+	ifstream cache_stream(CACHE_FILE, ios::binary);
+	if (cache_stream) {
+		cl::Program::Binaries binaries{ vector<unsigned char>((istreambuf_iterator<char>(cache_stream)), istreambuf_iterator<char>()) };
+		try {
+			cl::Program program(context, { device }, binaries);
+			program.build(options.c_str());
+			cout << "Loaded kernels from cache: " << CACHE_FILE << endl;
+			return program;
+		}
+		catch (const cl::Error&) {}
+	}
+
+	// 2. Attempt to build kernels from source
+	cl::Program program(context, source);
+	try {
+		program.build(options.c_str());
+	}
+	catch (const cl::Error& err) {
+		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device) << std::endl;
+		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+		throw err;
+	}
+
+	// 3. Store the binary for later runs. Failing to write the cache is not an error
+	cl::Program::Binaries binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+	save_program_cache(CACHE_FILE, binaries[0]);
+	return program;
+}
+
+// Shape of a binary PNM image, P5 (greyscale) or P6 (RGB), as declared by its header
+struct PnmHeader {
+	int width = 0, height = 0, channels = 0, max_value = 0;
+
+	int sample_size() const { return max_value > 255 ? 2 : 1; }
+	size_t pixel_count() const { return (size_t)width * height; }
+	size_t size() const { return (size_t)width * height * channels * sample_size(); } // Payload size in bytes
+	bool valid() const { return width > 0 && height > 0 && max_value > 0 && max_value <= 65535; }
+};
+
+// Reads the header of the next binary PNM frame from a stream of concatenated frames, skipping whitespace and comments
+// between its fields, and leaves the stream at the start of the payload. Returns false at the end of the stream.
+bool read_pnm_header(istream& in, PnmHeader& header) {
+	in >> ws;
+	if (in.peek() == char_traits<char>::eof())
+		return false;
+	char magic[2] = {};
+	in.read(magic, 2);
+	int fields[3] = {};
+	for (int& field : fields) {
+		while (in >> ws && in.peek() == '#')
+			in.ignore(numeric_limits<streamsize>::max(), '\n');
+		in >> field;
+	}
+	in.get(); // The single whitespace character before the payload
+	header.width = fields[0];
+	header.height = fields[1];
+	header.max_value = fields[2];
+	header.channels = (magic[1] == '6') ? 3 : 1;
+	if (!in || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6') || !header.valid())
+		throw CImgIOException("read_pnm_header: stream does not hold a binary PGM or PPM frame");
+	return true;
+}
+
+// Read-only memory map of a binary PNM image, either P5 (greyscale) or P6 (RGB). The header is parsed on opening and
+// pixels() points at the payload inside the mapping, so the host never copies the samples. As in the file, RGB samples
+// are interleaved and 16-bit samples are big-endian.
+class PnmFile {
+public:
+	explicit PnmFile(const string& filename) {
+		if (!map(filename)) {
+			unmap();
+			throw CImgIOException("PnmFile: cannot map file '%s'", filename.c_str());
+		}
+		if (!parse_header()) {
+			unmap();
+			throw CImgIOException("PnmFile: '%s' is not a binary PGM or PPM image", filename.c_str());
+		}
+	}
+
+	PnmFile(const PnmFile&) = delete;
+	PnmFile& operator=(const PnmFile&) = delete;
+
+	~PnmFile() {
+		unmap();
+	}
+
+	const PnmHeader& header() const { return header_; }
+	int width() const { return header_.width; }
+	int height() const { return header_.height; }
+	int channels() const { return header_.channels; }
+	int max_value() const { return header_.max_value; }
+	int sample_size() const { return header_.sample_size(); }
+	const unsigned char* pixels() const { return data_ + payload_offset_; }
+	size_t size() const { return header_.size(); } // Payload size in bytes
+
+private:
+	bool map(const string& filename) {
+#ifdef _WIN32
+		file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		LARGE_INTEGER file_size;
+		if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &file_size) || file_size.QuadPart == 0)
+			return false;
+		mapping_size_ = (size_t)file_size.QuadPart;
+		mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+		data_ = mapping_ ? (const unsigned char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+		file_ = open(filename.c_str(), O_RDONLY);
+		struct stat file_stat;
+		if (file_ < 0 || fstat(file_, &file_stat) != 0 || file_stat.st_size == 0)
+			return false;
+		mapping_size_ = (size_t)file_stat.st_size;
+		void* data = mmap(NULL, mapping_size_, PROT_READ, MAP_PRIVATE, file_, 0);
+		if (data == MAP_FAILED)
+			return false;
+		madvise(data, mapping_size_, MADV_SEQUENTIAL); // The upload reads the payload once, front to back
+		data_ = (const unsigned char*)data;
+#endif
+		return data_ != NULL;
+	}
+
+	void unmap() {
+#ifdef _WIN32
+		if (data_)
+			UnmapViewOfFile(data_);
+		if (mapping_)
+			CloseHandle(mapping_);
+		if (file_ != INVALID_HANDLE_VALUE)
+			CloseHandle(file_);
+#else
+		if (data_)
+			munmap((void*)data_, mapping_size_);
+		if (file_ >= 0)
+			close(file_);
+#endif
+	}
+
+	// Reads width, height and maximum value, skipping whitespace and comments between them. Each is read whole, and one
+	// too large for an int rejects the file, as does a maximum value above 65535. A single whitespace character separates
+	// the maximum value from the payload, which must lie entirely inside the file.
+	bool parse_header() {
+		if (mapping_size_ < 2 || data_[0] != 'P' || (data_[1] != '5' && data_[1] != '6'))
+			return false;
+		size_t position = 2;
+		int fields[3] = {};
+		for (int& field : fields) {
+			while (position < mapping_size_ && (isspace(data_[position]) || data_[position] == '#')) {
+				if (data_[position] == '#')
+					while (position < mapping_size_ && data_[position] != '\n')
+						position++;
+				else
+					position++;
+			}
+			if (position >= mapping_size_ || !isdigit(data_[position]))
+				return false;
+			long long value = 0;
+			while (position < mapping_size_ && isdigit(data_[position])) {
+				value = (value * 10) + (data_[position++] - '0');
+				if (value > numeric_limits<int>::max())
+					return false;
+			}
+			field = (int)value;
+		}
+		if (position >= mapping_size_ || !isspace(data_[position]))
+			return false;
+		header_.width = fields[0];
+		header_.height = fields[1];
+		header_.max_value = fields[2];
+		header_.channels = (data_[1] == '6') ? 3 : 1;
+		payload_offset_ = position + 1;
+		return header_.valid() && payload_offset_ + size() <= mapping_size_;
+	}
+
+#ifdef _WIN32
+	HANDLE file_ = INVALID_HANDLE_VALUE;
+	HANDLE mapping_ = NULL;
+#else
+	int file_ = -1;
+#endif
+	const unsigned char* data_ = NULL;
+	size_t mapping_size_ = 0;
+	size_t payload_offset_ = 0;
+	PnmHeader header_;
+};
+
+// Largest tile, in bytes, that process_tiled() streams through the device. Input and output tiles must each fit in one
+// allocation and together take at most half of global memory, leaving the rest to the histograms and the driver.
+size_t device_tile_size(const cl::Device& device) {
+	return min(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>(), device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 4);
+}
+
+// Histogram equalisation engine for workloads of many images. It holds the context and queue, builds the program for
+// pixel type T once, and keeps its kernels and device buffers in a PipelineCache between calls, so after it has seen
+// its largest image, process() creates no kernels or device buffers. With verbose unset, per-stage profiling info is
+// not printed, which matters when images are processed by the thousand.
+template <typename T>
+class Equalizer {
+public:
+	Equalizer(cl::Context& context, cl::CommandQueue& queue, int pixels_per_item = 0, PixelLayout layout = LAYOUT_PLANAR, bool verbose = true)
+		: Equalizer(context, queue, build_program(context, KERNEL_SOURCE, pixel_build_options<T>()), pixels_per_item, layout, verbose) {}
+
+	// Engines that share a program, e.g. one per queue, can be created from an already built one
+	Equalizer(cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, int pixels_per_item = 0, PixelLayout layout = LAYOUT_PLANAR, bool verbose = true)
+		: queue_(queue), cache_(context, program), pixels_per_item_(pixels_per_item), layout_(layout), verbose_(verbose) {}
+
+	CImg<T> process(const CImg<T>& input_image) {
+		CImg<T> output_image;
+		process(input_image, output_image);
+		return output_image;
+	}
+
+	// Runs the four pipeline stages as a single submission into output_image, which is only reallocated when the image
+	// dimensions change, and waits for the result.
+	void process(const CImg<T>& input_image, CImg<T>& output_image) {
+		submit(input_image, output_image).wait();
+		if (verbose_)
+			print_profiling_info();
+	}
+
+	void process(const PnmFile& file, CImg<T>& output_image) {
+		submit(file, output_image).wait();
+		if (verbose_ && fits_device(file.size()))
+			print_profiling_info(); // Tiled images have already been reported by process_tiled()
+	}
+
+	// Enqueues the four pipeline stages without waiting for them and returns the event of the final read-back. Every
+	// command waits only on the events of the commands it depends on and all intermediates stay in device memory.
+	// input_image and output_image must stay alive and untouched until the returned event has completed.
+	cl::Event submit(const CImg<T>& input_image, CImg<T>& output_image) {
+		const int BIN_COUNT = input_image.max() + 1;
+		const int CHANNEL_COUNT = channel_count(input_image, layout_);
+		const int PIXEL_COUNT = checked_pixel_count(input_image.size() / CHANNEL_COUNT);
+		const size_t IMAGE_SIZE = input_image.size() * sizeof(T);
+
+		cl::Buffer& input_image_buffer = cache_.buffer("image", IMAGE_SIZE, CL_MEM_READ_ONLY);
+		upload_events_.resize(1);
+		queue_.enqueueWriteBuffer(input_image_buffer, CL_FALSE, 0, IMAGE_SIZE, input_image.data(), NULL, &upload_events_[0]);
+		convert_events_.clear();
+		output_image.assign(input_image.width(), input_image.height(), input_image.depth(), input_image.spectrum());
+		return enqueue_pipeline(input_image_buffer, BIN_COUNT, CHANNEL_COUNT, PIXEL_COUNT, output_image.data());
+	}
+
+	// Enqueues the pipeline over a memory-mapped binary PNM image, uploading its payload straight from the mapping. file
+	// must stay mapped until the returned event has completed.
+	cl::Event submit(const PnmFile& file, CImg<T>& output_image) {
+		return submit(file.header(), file.pixels(), output_image);
+	}
+
+	// Enqueues the pipeline over the raw payload of a binary PNM image and returns the event of the final read-back into
+	// output_image, which is interleaved like the payload. 16-bit samples are converted from big-endian on the device,
+	// where samples above the header's maximum value are also clamped to it.
+	// Bins run up to the maximum value in the header rather than in the image, so the host never reads the pixels. RGB
+	// images need the interleaved layout, and payload must stay untouched until the returned event has completed.
+	// Payloads larger than the device's largest allocation are equalised with process_tiled() instead, which blocks.
+	cl::Event submit(const PnmHeader& header, const unsigned char* payload, CImg<T>& output_image) {
+		if (!fits_device(header.size()))
+			return submit_tiled(header, payload, output_image);
+		cl::Buffer& input_image_buffer = enqueue_payload_upload(header, payload);
+		output_image.assign(header.channels, header.width, header.height);
+		return enqueue_pipeline(input_image_buffer, header.max_value + 1, header.channels, (int)header.pixel_count(), output_image.data());
+	}
+
+	// Enqueues one frame of an image sequence like submit() does, but maps it through the lookup table built from the
+	// frames before it. Only then is the frame's own histogram blended into a device-resident running average, with
+	// weight alpha, and the table rebuilt for the next frame, so histogram and scan run while the host handles the
+	// result instead of delaying it, and the table changes gradually rather than flickering. The average starts afresh
+	// from the first frame and whenever the bin or channel count changes. Frames too large for one device allocation are
+	// equalised on their own with process_tiled(), like submit() does, and leave the average untouched. Samples above the
+	// header's maximum value are clamped on upload, so they never reach the average.
+	cl::Event submit_sequence(const PnmHeader& header, const unsigned char* payload, CImg<T>& output_image, float alpha) {
+		if (!fits_device(header.size()))
+			return submit_tiled(header, payload, output_image);
+		const int BIN_COUNT = header.max_value + 1;
+		const int CHANNEL_COUNT = header.channels;
+		const int PIXEL_COUNT = checked_pixel_count(header.pixel_count());
+		const size_t IMAGE_SIZE = header.size();
+
+		// 1. Enqueue uploads of the frame and its image data
+		cl::Buffer& input_image_buffer = enqueue_payload_upload(header, payload);
+		cl::Buffer& lut_buffer = lookup_table_buffer("sequence_lut", BIN_COUNT * CHANNEL_COUNT * sizeof(T));
+		cl::Buffer& output_buffer = cache_.buffer("output", IMAGE_SIZE);
+		cl::Buffer& image_data_buffer = cache_.buffer("image_data", sizeof(int) * 4, CL_MEM_READ_ONLY);
+		image_data_[0] = BIN_COUNT; // A member, so that it outlives the non-blocking write below
+		image_data_[1] = CHANNEL_COUNT;
+		image_data_[2] = PIXEL_COUNT;
+		image_data_[3] = layout_;
+		upload_events_.emplace_back();
+		queue_.enqueueWriteBuffer(image_data_buffer, CL_FALSE, 0, sizeof(image_data_), image_data_, NULL, &upload_events_.back());
+
+		// 2. Without a table for frames of this shape, build one from this frame alone first
+		if (BIN_COUNT != sequence_bin_count_ || CHANNEL_COUNT != sequence_channel_count_) {
+			sequence_bin_count_ = BIN_COUNT;
+			sequence_channel_count_ = CHANNEL_COUNT;
+			enqueue_sequence_update(input_image_buffer, image_data_buffer, lut_buffer, BIN_COUNT, CHANNEL_COUNT, PIXEL_COUNT, 1.0f);
+		}
+
+		// 3. Map the frame through the current table and read it back
+		vector<cl::Event>& map_wait_events = cache_.events("map");
+		map_wait_events.assign(upload_events_.begin(), upload_events_.end());
+		map_wait_events.push_back(lut_event_);
+		enqueue_map<T>(cache_, queue_, input_image_buffer, lut_buffer, output_buffer, image_data_buffer, BIN_COUNT, CHANNEL_COUNT, PIXEL_COUNT, &map_wait_events, map_event_, layout_);
+		output_image.assign(CHANNEL_COUNT, header.width, header.height);
+		queue_.enqueueReadBuffer(output_buffer, CL_FALSE, 0, IMAGE_SIZE, output_image.data(), cache_.wait_list("output", map_event_), &output_event_);
+
+		// 4. Blend the frame into the average and rebuild the table for the next frame. The queue is in order, so this
+		// runs behind the read-back and the table is not overwritten before the map has read it
+		enqueue_sequence_update(input_image_buffer, image_data_buffer, lut_buffer, BIN_COUNT, CHANNEL_COUNT, PIXEL_COUNT, alpha);
+		queue_.flush();
+		return output_event_;
+	}
+
+	vector<CImg<T>> process_batch(const vector<CImg<T>>& input_images) {
+		vector<CImg<T>> output_images;
+		process_batch(input_images, output_images);
+		return output_images;
+	}
+
+	// Equalises many small planar images with one launch per stage for the whole batch, where per-image launches and
+	// transfers would cost more than the work itself. The images are packed into one buffer alongside a table of their
+	// segments (see kernels.cl), uploaded and read back with one transfer each, and unpacked into output_images. A batch
+	// whose largest histogram does not fit in local memory is processed one image at a time instead.
+	void process_batch(const vector<CImg<T>>& input_images, vector<CImg<T>>& output_images) {
+		auto start = chrono::high_resolution_clock::now();
+		output_images.resize(input_images.size());
+
+		// 1. Lay out the segments of every channel of every image
+		segments_.clear();
+		int pixel_offset = 0, bin_offset = 0, max_bin_count = 0, max_pixel_count = 0;
+		for (const CImg<T>& image : input_images) {
+			const int BIN_COUNT = image.max() + 1;
+			const int PIXEL_COUNT = image.width() * image.height() * image.depth();
+			for (int channel = 0; channel < image.spectrum(); channel++)
+				segments_.insert(segments_.end(), { pixel_offset + (PIXEL_COUNT * channel), PIXEL_COUNT, bin_offset + (BIN_COUNT * channel), BIN_COUNT });
+			pixel_offset += image.size();
+			bin_offset += BIN_COUNT * image.spectrum();
+			max_bin_count = max(max_bin_count, BIN_COUNT);
+			max_pixel_count = max(max_pixel_count, PIXEL_COUNT);
+		}
+		const int SEGMENT_COUNT = segments_.size() / 4;
+		if (SEGMENT_COUNT == 0)
+			return;
+		if ((cl_ulong)max_bin_count * sizeof(int) > cache_.device().getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) {
+			for (size_t i = 0; i < input_images.size(); i++)
+				submit(input_images[i], output_images[i]).wait();
+			return;
+		}
+
+		// 2. Pack the images and upload them with the segment table
+		packed_.resize(pixel_offset);
+		for (size_t i = 0, offset = 0; i < input_images.size(); offset += input_images[i].size(), i++)
+			copy(input_images[i].begin(), input_images[i].end(), packed_.begin() + offset);
+		const size_t IMAGE_SIZE = packed_.size() * sizeof(T);
+		cl::Buffer& image_buffer = cache_.buffer("image", IMAGE_SIZE, CL_MEM_READ_ONLY);
+		cl::Buffer& histogram_buffer = cache_.buffer("histogram", bin_offset * sizeof(int));
+		cl::Buffer& cumulative_histogram_buffer = cache_.buffer("cumulative_histogram", bin_offset * sizeof(int));
+		cl::Buffer& lut_buffer = lookup_table_buffer("lut", bin_offset * sizeof(T));
+		cl::Buffer& output_buffer = cache_.buffer("output", IMAGE_SIZE);
+		cl::Buffer& segment_buffer = cache_.buffer("segments", segments_.size() * sizeof(int), CL_MEM_READ_ONLY);
+		vector<cl::Event> upload_events(2);
+		queue_.enqueueWriteBuffer(image_buffer, CL_FALSE, 0, IMAGE_SIZE, packed_.data(), NULL, &upload_events[0]);
+		queue_.enqueueWriteBuffer(segment_buffer, CL_FALSE, 0, segments_.size() * sizeof(int), segments_.data(), NULL, &upload_events[1]);
+
+		// 3. Enqueue one launch per stage. Histograms and scans take one work group per segment
+		cl::Device& device = cache_.device();
+		cl::Kernel& histogram_kernel = cache_.kernel("create_intensity_histogram_batched");
+		const size_t HISTOGRAM_LOCAL_SIZE = histogram_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+		histogram_kernel.setArg(0, image_buffer);
+		histogram_kernel.setArg(1, histogram_buffer);
+		histogram_kernel.setArg(2, cl::Local(max_bin_count * sizeof(int)));
+		histogram_kernel.setArg(3, segment_buffer);
+		cl::Event histogram_event;
+		queue_.enqueueNDRangeKernel(histogram_kernel, cl::NullRange, cl::NDRange(HISTOGRAM_LOCAL_SIZE, SEGMENT_COUNT), cl::NDRange(HISTOGRAM_LOCAL_SIZE, 1), &upload_events, &histogram_event);
+
+		cl::Kernel& scan_kernel = cache_.kernel("cumulate_histogram_batched");
+		size_t scan_local = scan_local_size(scan_kernel, device);
+		while (scan_local > 1 && max_bin_count <= (int)scan_local) // Shrink to the smallest block that still covers every bin
+			scan_local /= 2;
+		scan_kernel.setArg(0, histogram_buffer);
+		scan_kernel.setArg(1, cumulative_histogram_buffer);
+		scan_kernel.setArg(2, cl::Local(scan_local * 2 * sizeof(int)));
+		scan_kernel.setArg(3, segment_buffer);
+		vector<cl::Event> scan_wait_events{ histogram_event };
+		cl::Event scan_event;
+		queue_.enqueueNDRangeKernel(scan_kernel, cl::NullRange, cl::NDRange(scan_local, SEGMENT_COUNT), cl::NDRange(scan_local, 1), &scan_wait_events, &scan_event);
+
+		cl::Kernel& lut_kernel = cache_.kernel("build_lookup_table_batched");
+		lut_kernel.setArg(0, cumulative_histogram_buffer);
+		lut_kernel.setArg(1, lut_buffer);
+		lut_kernel.setArg(2, segment_buffer);
+		vector<cl::Event> lut_wait_events{ scan_event };
+		cl::Event lut_event;
+		queue_.enqueueNDRangeKernel(lut_kernel, cl::NullRange, cl::NDRange(max_bin_count, SEGMENT_COUNT), cl::NullRange, &lut_wait_events, &lut_event);
+
+		cl::Kernel& map_kernel = cache_.kernel("map_lookup_table_to_image_batched");
+		map_kernel.setArg(0, image_buffer);
+		map_kernel.setArg(1, lut_buffer);
+		map_kernel.setArg(2, output_buffer);
+		map_kernel.setArg(3, segment_buffer);
+		vector<cl::Event> map_wait_events{ lut_event };
+		cl::Event map_event;
+		queue_.enqueueNDRangeKernel(map_kernel, cl::NullRange, cl::NDRange(max_pixel_count, SEGMENT_COUNT), cl::NullRange, &map_wait_events, &map_event);
+
+		// 4. Read the packed result back over the packed input, which the in-order queue has finished uploading by then,
+		// and unpack it into the output images
+		vector<cl::Event> output_wait_events{ map_event };
+		cl::Event output_event;
+		queue_.enqueueReadBuffer(output_buffer, CL_FALSE, 0, IMAGE_SIZE, packed_.data(), &output_wait_events, &output_event);
+		output_event.wait();
+		for (size_t i = 0, offset = 0; i < input_images.size(); offset += input_images[i].size(), i++) {
+			output_images[i].assign(input_images[i].width(), input_images[i].height(), input_images[i].depth(), input_images[i].spectrum());
+			copy(packed_.begin() + offset, packed_.begin() + offset + input_images[i].size(), output_images[i].begin());
+		}
+
+		// 5. Report profiling info
+		if (!verbose_)
+			return;
+		auto latency = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+		cout << "[ BATCHED EQUALISATION ]" << endl;
+		cout << "Load image buffer: " << GetFullProfilingInfo(upload_events[0], PROF_US) << endl;
+		cout << "Generate intensity histogram: " << GetFullProfilingInfo(histogram_event, PROF_US) << endl;
+		cout << "Generate cumulative histogram: " << GetFullProfilingInfo(scan_event, PROF_US) << endl;
+		cout << "Generate lookup table: " << GetFullProfilingInfo(lut_event, PROF_US) << endl;
+		cout << "Generate modified image: " << GetFullProfilingInfo(map_event, PROF_US) << endl;
+		cout << "Retrieve modified image : " << GetFullProfilingInfo(output_event, PROF_US) << endl;
+		cout << "Amortised per-image latency: " << latency.count() / input_images.size() << " [us] over " << input_images.size() << " images" << endl;
+	}
+
+	// Equalises images too large for device memory in tiles of at most max_tile_size bytes, or of device_tile_size()
+	// when it is 0. Pass one streams every tile through the histogram kernels into one histogram of the whole image, the
+	// scan and lookup table are built once from it, and pass two streams the same tiles through the map kernel. A tile is
+	// a run of whole pixels, so a planar tile takes that run from every channel.
+	void process_tiled(const CImg<T>& input_image, CImg<T>& output_image, size_t max_tile_size = 0) {
+		auto start = chrono::high_resolution_clock::now();
+		const int BIN_COUNT = input_image.max() + 1;
+		const int CHANNEL_COUNT = channel_count(input_image, layout_);
+		const int PIXEL_COUNT = checked_pixel_count(input_image.size() / CHANNEL_COUNT);
+		const int HISTOGRAM_SIZE = BIN_COUNT * CHANNEL_COUNT * sizeof(int);
+		const size_t PIXEL_SIZE = CHANNEL_COUNT * sizeof(T);
+		const int TILE_PIXELS = max<size_t>(1, min<size_t>(PIXEL_COUNT, (max_tile_size ? max_tile_size : device_tile_size(cache_.device())) / PIXEL_SIZE));
+		const int TILE_COUNT = (PIXEL_COUNT + TILE_PIXELS - 1) / TILE_PIXELS;
+
+		// 1. Fetch buffers from the cache and upload the image data of the whole image, of full tiles and of the last tile
+		cl::Buffer& tile_buffer = cache_.buffer("image", TILE_PIXELS * PIXEL_SIZE, CL_MEM_READ_ONLY);
+		cl::Buffer& output_tile_buffer = cache_.buffer("output", TILE_PIXELS * PIXEL_SIZE);
+		cl::Buffer& histogram_buffer = cache_.buffer("histogram", HISTOGRAM_SIZE);
+		cl::Buffer& cumulative_histogram_buffer = cache_.buffer("cumulative_histogram", HISTOGRAM_SIZE);
+		cl::Buffer& lut_buffer = lookup_table_buffer("lut", BIN_COUNT * CHANNEL_COUNT * sizeof(T));
+		cl::Buffer* tile_data_buffers[3] = {
+			&cache_.buffer("image_data", sizeof(int) * 4, CL_MEM_READ_ONLY),
+			&cache_.buffer("tile_data", sizeof(int) * 4, CL_MEM_READ_ONLY),
+			&cache_.buffer("last_tile_data", sizeof(int) * 4, CL_MEM_READ_ONLY) };
+		const int TILE_PIXEL_COUNTS[3] = { PIXEL_COUNT, TILE_PIXELS, PIXEL_COUNT - ((TILE_COUNT - 1) * TILE_PIXELS) };
+		upload_events_.resize(4);
+		for (int i = 0; i < 3; i++) {
+			int* tile_data = tile_data_[i]; // Members, so that they outlive the non-blocking writes
+			tile_data[0] = BIN_COUNT;
+			tile_data[1] = CHANNEL_COUNT;
+			tile_data[2] = TILE_PIXEL_COUNTS[i];
+			tile_data[3] = layout_;
+			queue_.enqueueWriteBuffer(*tile_data_buffers[i], CL_FALSE, 0, sizeof(tile_data_[i]), tile_data, NULL, &upload_events_[i]);
+		}
+		queue_.enqueueFillBuffer(histogram_buffer, 0, 0, HISTOGRAM_SIZE, NULL, &upload_events_[3]);
+
+		// 2. Pass one: stream the tiles through the histogram kernels, which add to the histogram. The queue is in order,
+		// so each tile upload also waits for the kernels still reading the previous tile
+		histogram_events_.clear();
+		vector<cl::Event> tile_events;
+		for (int tile = 0; tile < TILE_COUNT; tile++) {
+			const bool LAST_TILE = tile == TILE_COUNT - 1;
+			const int TILE_PIXEL_COUNT = TILE_PIXEL_COUNTS[LAST_TILE ? 2 : 1];
+			const size_t FIRST_PIXEL = (size_t)tile * TILE_PIXELS;
+			tile_events.assign(upload_events_.begin(), upload_events_.end());
+			enqueue_tile_upload(input_image, tile_buffer, FIRST_PIXEL, TILE_PIXEL_COUNT, tile_events);
+			enqueue_histogram(cache_, queue_, tile_buffer, histogram_buffer, *tile_data_buffers[LAST_TILE ? 2 : 1], BIN_COUNT, CHANNEL_COUNT, TILE_PIXEL_COUNT, &tile_events, histogram_events_, pixels_per_item_, layout_);
+		}
+
+		// 3. Build the lookup table of the whole image once
+		vector<cl::Event> scan_wait_events{ histogram_events_.back() };
+		scan_events_.clear();
+		enqueue_scan(cache_, queue_, histogram_buffer, cumulative_histogram_buffer, BIN_COUNT, CHANNEL_COUNT, &scan_wait_events, scan_events_);
+		vector<cl::Event> lut_wait_events{ scan_events_.back() };
+		enqueue_lookup_table(cache_, queue_, cumulative_histogram_buffer, lut_buffer, *tile_data_buffers[0], BIN_COUNT, CHANNEL_COUNT, &lut_wait_events, lut_event_);
+
+		// 4. Pass two: stream the tiles through the map kernel and read each one back into its place in the output image
+		output_image.assign(input_image.width(), input_image.height(), input_image.depth(), input_image.spectrum());
+		cl::Event first_map_upload;
+		for (int tile = 0; tile < TILE_COUNT; tile++) {
+			const bool LAST_TILE = tile == TILE_COUNT - 1;
+			const int TILE_PIXEL_COUNT = TILE_PIXEL_COUNTS[LAST_TILE ? 2 : 1];
+			const size_t FIRST_PIXEL = (size_t)tile * TILE_PIXELS;
+			tile_events.assign(1, lut_event_);
+			enqueue_tile_upload(input_image, tile_buffer, FIRST_PIXEL, TILE_PIXEL_COUNT, tile_events);
+			if (tile == 0)
+				first_map_upload = tile_events[1];
+			enqueue_map<T>(cache_, queue_, tile_buffer, lut_buffer, output_tile_buffer, *tile_data_buffers[LAST_TILE ? 2 : 1], BIN_COUNT, CHANNEL_COUNT, TILE_PIXEL_COUNT, &tile_events, map_event_, layout_);
+			vector<cl::Event> output_wait_events{ map_event_ };
+			if (layout_ == LAYOUT_INTERLEAVED)
+				queue_.enqueueReadBuffer(output_tile_buffer, CL_FALSE, 0, TILE_PIXEL_COUNT * PIXEL_SIZE, output_image.data() + (FIRST_PIXEL * CHANNEL_COUNT), &output_wait_events, &output_event_);
+			else for (int channel = 0; channel < CHANNEL_COUNT; channel++)
+				queue_.enqueueReadBuffer(output_tile_buffer, CL_FALSE, (size_t)TILE_PIXEL_COUNT * channel * sizeof(T), TILE_PIXEL_COUNT * sizeof(T), output_image.data() + ((size_t)PIXEL_COUNT * channel) + FIRST_PIXEL, &output_wait_events, &output_event_);
+		}
+		output_event_.wait();
+
+		// 5. Report profiling info
+		if (!verbose_)
+			return;
+		auto latency = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+		cout << "[ TILED EQUALISATION ]" << endl;
+		cout << "Tiles: " << TILE_COUNT << " of up to " << TILE_PIXELS << " pixels (" << TILE_PIXELS * PIXEL_SIZE << " [B])" << endl;
+		cout << "Pass one, upload and histogram: " << (histogram_events_.back().getProfilingInfo<CL_PROFILING_COMMAND_END>() - upload_events_[0].getProfilingInfo<CL_PROFILING_COMMAND_START>()) / PROF_US << " [us]" << endl;
+		for (const cl::Event& scan_event : scan_events_)
+			cout << "Generate cumulative histogram: " << GetFullProfilingInfo(scan_event, PROF_US) << endl;
+		cout << "Generate lookup table: " << GetFullProfilingInfo(lut_event_, PROF_US) << endl;
+		cout << "Pass two, upload, map and read-back: " << (output_event_.getProfilingInfo<CL_PROFILING_COMMAND_END>() - first_map_upload.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / PROF_US << " [us]" << endl;
+		cout << "Tiled per-image latency: " << latency.count() << " [us]" << endl;
+	}
+
+	// Prints the profiling info of the last submission, which must have completed
+	void print_profiling_info() const {
+		cout << "[ FUSED EQUALISATION ]" << endl;
+		cout << "Load image buffer: " << GetFullProfilingInfo(upload_events_[0], PROF_US) << endl;
+		for (const cl::Event& convert_event : convert_events_)
+			cout << "Prepare samples: " << GetFullProfilingInfo(convert_event, PROF_US) << endl;
+		for (const cl::Event& histogram_event : histogram_events_)
+			cout << "Generate intensity histogram: " << GetFullProfilingInfo(histogram_event, PROF_US) << endl;
+		for (const cl::Event& scan_event : scan_events_)
+			cout << "Generate cumulative histogram: " << GetFullProfilingInfo(scan_event, PROF_US) << endl;
+		cout << "Generate lookup table: " << GetFullProfilingInfo(lut_event_, PROF_US) << endl;
+		cout << "Generate modified image: " << GetFullProfilingInfo(map_event_, PROF_US) << endl;
+		cout << "Retrieve modified image : " << GetFullProfilingInfo(output_event_, PROF_US) << endl;
+		cout << "Device time, first upload queued to read-back end: " << (output_event_.getProfilingInfo<CL_PROFILING_COMMAND_END>() - upload_events_[0].getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / PROF_US << " [us]" << endl;
+	}
+
+	// Runs the same four stages through the per-stage functions, each linked to the one before it by its events. Nothing
+	// blocks until the host waits on the final read-back into output_image, after which the profiling info of every stage
+	// is printed. zero_copy only applies when both images are in aligned storage (see AlignedImage), and a nonzero
+	// copy_transfer_ns, the time explicit transfers of the image take, is reported against the zero-copy transfers.
+	void process_staged(const CImg<T>& input_image, CImg<T>& output_image, bool zero_copy = false, cl_ulong copy_transfer_ns = 0) {
+		output_image.assign(input_image.width(), input_image.height(), input_image.depth(), input_image.spectrum());
+		zero_copy = zero_copy && zero_copy_aligned(queue_, input_image.data()) && zero_copy_aligned(queue_, output_image.data());
+		const int BIN_COUNT = input_image.max() + 1; // One bin for every intensity from 0 to max inclusive
+		const int CHANNEL_COUNT = channel_count(input_image, layout_);
+		const int PIXEL_COUNT = checked_pixel_count(input_image.size() / CHANNEL_COUNT);
+
+		// 1. Enqueue stages
+		vector<int> image_data{ BIN_COUNT, CHANNEL_COUNT, PIXEL_COUNT, layout_ }; // Must outlive the non-blocking upload
+		cl::Buffer image_data_buffer;
+		vector<cl::Event> upload_events;
+		cl::Buffer image = upload_image(cache_, queue_, input_image, image_data, image_data_buffer, upload_events, zero_copy);
+		vector<cl::Event> histogram_events;
+		cl::Buffer histogram = create_intensity_histogram(cache_, queue_, image, image_data_buffer, BIN_COUNT, CHANNEL_COUNT, PIXEL_COUNT, &upload_events, histogram_events, pixels_per_item_, layout_);
+		vector<cl::Event> scan_wait_events{ histogram_events.back() };
+		vector<cl::Event> scan_events;
+		cl::Buffer cumulative_histogram = cumulate_histogram(cache_, queue_, histogram, BIN_COUNT, CHANNEL_COUNT, &scan_wait_events, scan_events);
+		vector<cl::Event> lut_wait_events{ scan_events.back() };
+		cl::Event lut_event;
+		lookup_table_buffer("lut", BIN_COUNT * CHANNEL_COUNT * sizeof(T)); // Same pooled buffer build_lookup_table() fetches
+		cl::Buffer lut = build_lookup_table<T>(cache_, queue_, cumulative_histogram, image_data_buffer, BIN_COUNT, CHANNEL_COUNT, &lut_wait_events, lut_event);
+		vector<cl::Event> map_wait_events{ lut_event };
+		cl::Event map_event;
+		vector<cl::Event> output_events;
+		map_lookup_table_to_image(cache_, queue_, image, lut, image_data_buffer, BIN_COUNT, CHANNEL_COUNT, PIXEL_COUNT, output_image, &map_wait_events, map_event, output_events, layout_, zero_copy);
+
+		// 2. Synchronise once. The queue is in order, so every earlier command has completed too
+		output_events.back().wait();
+
+		// 3. Print profiling info
+		if (!verbose_)
+			return;
+		if (!zero_copy)
+			print_profiling("LOAD IMAGE", "Load image buffer", { upload_events[1] });
+		print_profiling("CREATE INTENSITY HISTOGRAM", "Generate intensity histogram", histogram_events);
+		print_profiling("CUMULATE HISTOGRAM", "Generate cumulative histogram", scan_events);
+		print_profiling("BUILD LOOKUP TABLE", "Generate lookup table", { lut_event });
+		print_profiling("MAP LOOKUP TABLE TO IMAGE", "Generate modified image", { map_event });
+		if (!zero_copy) {
+			cout << "Retrieve modified image : " << GetFullProfilingInfo(output_events[0], PROF_US) << endl;
+			return;
+		}
+		cout << "Map modified image: " << GetFullProfilingInfo(output_events[0], PROF_US) << endl;
+		cout << "Unmap modified image: " << GetFullProfilingInfo(output_events[1], PROF_US) << endl;
+		const cl_ulong ZERO_COPY_NS = event_duration(output_events[0]) + event_duration(output_events[1]);
+		if (copy_transfer_ns > 0)
+			cout << "Saved transfer time (zero-copy): " << ((long long)copy_transfer_ns - (long long)ZERO_COPY_NS) / PROF_US << " [us]" << endl;
+	}
+
+	// Reads back the lookup table of the last submission, which must have completed. It holds one table of bin count
+	// entries per channel, and after process_batch() one such run per image, in input order.
+	vector<T> lookup_table() {
+		return read_lookup_table<T>(queue_, cache_.buffer(lut_role_, lut_size_), lut_size_ / sizeof(T));
+	}
+
+private:
+	// Pixel counts reach the kernels as int, and histogram bins are 32-bit counters, so larger images cannot be equalised
+	static int checked_pixel_count(size_t pixel_count) {
+		if (pixel_count == 0 || pixel_count > (size_t)numeric_limits<int>::max())
+			throw CImgArgumentException("Equalizer: images must have from 1 to %d pixels, not %llu", numeric_limits<int>::max(), (unsigned long long)pixel_count);
+		return (int)pixel_count;
+	}
+
+	bool fits_device(size_t size) {
+		return size <= cache_.device().getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	}
+
+	// Equalises a binary PNM payload with process_tiled() and returns the event of its last read-back, which has then
+	// completed. 8-bit payloads are tiled straight from where they lie, while 16-bit ones are converted from big-endian
+	// into a host copy first, as the device converts only whole images.
+	cl::Event submit_tiled(const PnmHeader& header, const unsigned char* payload, CImg<T>& output_image) {
+		if (header.sample_size() != (int)sizeof(T))
+			throw CImgArgumentException("Equalizer: %d-byte samples cannot be equalised as %d-byte pixels", header.sample_size(), (int)sizeof(T));
+		if (header.channels > 1 && layout_ != LAYOUT_INTERLEAVED)
+			throw CImgArgumentException("Equalizer: RGB images can only be equalised with the interleaved layout");
+		CImg<T> input_image(reinterpret_cast<const T*>(payload), header.channels, header.width, header.height, 1, sizeof(T) == 1);
+		if (sizeof(T) > 1)
+			input_image.invert_endianness();
+		process_tiled(input_image, output_image);
+		return output_event_;
+	}
+
+	// Fetches the buffer the pipeline builds its lookup table in, remembering it for lookup_table()
+	cl::Buffer& lookup_table_buffer(const char* role, size_t size) {
+		lut_role_ = role;
+		lut_size_ = size;
+		return cache_.buffer(role, size);
+	}
+
+	// Enqueues the upload of a binary PNM payload into device memory and its preparation there: 16-bit samples are
+	// converted from big-endian, and samples above the header's maximum value, which every later stage sizes its bins by,
+	// are clamped to it. 8-bit payloads declaring a maximum of 255 need neither, and skip the pass. Leaves the upload
+	// first in upload_events_, followed by the preparation.
+	cl::Buffer& enqueue_payload_upload(const PnmHeader& header, const unsigned char* payload) {
+		if (header.sample_size() != (int)sizeof(T))
+			throw CImgArgumentException("Equalizer: %d-byte samples cannot be equalised as %d-byte pixels", header.sample_size(), (int)sizeof(T));
+		if (header.channels > 1 && layout_ != LAYOUT_INTERLEAVED)
+			throw CImgArgumentException("Equalizer: RGB images can only be equalised with the interleaved layout");
+		if (header.size() > cache_.device().getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+			throw CImgArgumentException("Equalizer: the %lu-byte payload exceeds the device's largest allocation, equalise it tiled instead", (unsigned long)header.size());
+		checked_pixel_count(header.pixel_count());
+
+		// The device converts the samples in place, so this is not the read-only buffer submit() uploads images to
+		cl::Buffer& input_image_buffer = cache_.buffer("mapped_image", header.size());
+		upload_events_.resize(1);
+		queue_.enqueueWriteBuffer(input_image_buffer, CL_FALSE, 0, header.size(), payload, NULL, &upload_events_[0]);
+		convert_events_.clear();
+		if (sizeof(T) > 1 || header.max_value < numeric_limits<T>::max()) {
+			cl::Kernel& prepare_kernel = cache_.kernel("prepare_samples");
+			prepare_kernel.setArg(0, input_image_buffer);
+			prepare_kernel.setArg(1, header.max_value);
+			convert_events_.resize(1);
+			queue_.enqueueNDRangeKernel(prepare_kernel, cl::NullRange, cl::NDRange(header.pixel_count() * header.channels), cl::NullRange, &upload_events_, &convert_events_[0]);
+			upload_events_.push_back(convert_events_[0]);
+		}
+		return input_image_buffer;
+	}
+
+	// Enqueues the histogram of a sequence frame, its blend into the running average and the rebuild of the lookup
+	// table from the average, leaving the event of the table in lut_event_
+	void enqueue_sequence_update(cl::Buffer& input_image_buffer, cl::Buffer& image_data_buffer, cl::Buffer& lut_buffer, int bin_count, int channels, int pixel_count, float alpha) {
+		const int HISTOGRAM_SIZE = bin_count * channels * sizeof(int);
+		cl::Buffer& histogram_buffer = cache_.buffer("histogram", HISTOGRAM_SIZE);
+		cl::Buffer& smoothed_histogram_buffer = cache_.buffer("smoothed_histogram", bin_count * channels * sizeof(float));
+		cl::Buffer& cumulative_histogram_buffer = cache_.buffer("cumulative_histogram", HISTOGRAM_SIZE);
+
+		vector<cl::Event>& histogram_wait_events = cache_.events("histogram");
+		histogram_wait_events.assign(upload_events_.begin(), upload_events_.end());
+		histogram_wait_events.emplace_back();
+		queue_.enqueueFillBuffer(histogram_buffer, 0, 0, HISTOGRAM_SIZE, NULL, &histogram_wait_events.back());
+		histogram_events_.clear();
+		enqueue_histogram(cache_, queue_, input_image_buffer, histogram_buffer, image_data_buffer, bin_count, channels, pixel_count, &histogram_wait_events, histogram_events_, pixels_per_item_, layout_);
+
+		cl::Kernel& smooth_kernel = cache_.kernel("smooth_histogram");
+		smooth_kernel.setArg(0, histogram_buffer);
+		smooth_kernel.setArg(1, smoothed_histogram_buffer);
+		smooth_kernel.setArg(2, image_data_buffer);
+		smooth_kernel.setArg(3, alpha);
+		cl::Event smooth_event;
+		queue_.enqueueNDRangeKernel(smooth_kernel, cl::NullRange, cl::NDRange(bin_count * channels), cl::NullRange, cache_.wait_list("smooth", histogram_events_.back()), &smooth_event);
+
+		scan_events_.clear();
+		enqueue_scan(cache_, queue_, histogram_buffer, cumulative_histogram_buffer, bin_count, channels, cache_.wait_list("scan", smooth_event), scan_events_);
+		enqueue_lookup_table(cache_, queue_, cumulative_histogram_buffer, lut_buffer, image_data_buffer, bin_count, channels, cache_.wait_list("lut", scan_events_.back()), lut_event_);
+	}
+
+	// Enqueues the upload of the tile_pixel_count pixels from first_pixel on, appending one event per copy. A planar
+	// tile takes one copy per channel and is laid out in tile_buffer as a planar image of its own.
+	void enqueue_tile_upload(const CImg<T>& input_image, cl::Buffer& tile_buffer, size_t first_pixel, int tile_pixel_count, vector<cl::Event>& copy_events) {
+		const int CHANNEL_COUNT = channel_count(input_image, layout_);
+		const size_t PIXEL_COUNT = input_image.size() / CHANNEL_COUNT;
+		if (layout_ == LAYOUT_INTERLEAVED) {
+			copy_events.emplace_back();
+			queue_.enqueueWriteBuffer(tile_buffer, CL_FALSE, 0, tile_pixel_count * CHANNEL_COUNT * sizeof(T), input_image.data() + (first_pixel * CHANNEL_COUNT), NULL, &copy_events.back());
+			return;
+		}
+		for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+			copy_events.emplace_back();
+			queue_.enqueueWriteBuffer(tile_buffer, CL_FALSE, (size_t)tile_pixel_count * channel * sizeof(T), tile_pixel_count * sizeof(T), input_image.data() + (PIXEL_COUNT * channel) + first_pixel, NULL, &copy_events.back());
+		}
+	}
+
+	// Enqueues everything after the image upload, which submit() leaves first in upload_events_ followed by any
+	// conversions of the image, and returns the event of the read-back into output_data
+	cl::Event enqueue_pipeline(cl::Buffer& input_image_buffer, int bin_count, int channels, int pixel_count, T* output_data) {
+		const int HISTOGRAM_SIZE = bin_count * channels * sizeof(int);
+		const size_t IMAGE_SIZE = (size_t)pixel_count * channels * sizeof(T);
+
+		// 1. Fetch the remaining buffers from the cache and enqueue the remaining uploads
+		cl::Buffer& histogram_buffer = cache_.buffer("histogram", HISTOGRAM_SIZE);
+		cl::Buffer& cumulative_histogram_buffer = cache_.buffer("cumulative_histogram", HISTOGRAM_SIZE);
+		cl::Buffer& lut_buffer = lookup_table_buffer("lut", bin_count * channels * sizeof(T));
+		cl::Buffer& output_buffer = cache_.buffer("output", IMAGE_SIZE);
+		cl::Buffer& image_data_buffer = cache_.buffer("image_data", sizeof(int) * 4, CL_MEM_READ_ONLY);
+		image_data_[0] = bin_count; // A member, so that it outlives the non-blocking write below
+		image_data_[1] = channels;
+		image_data_[2] = pixel_count;
+		image_data_[3] = layout_;
+		upload_events_.resize(upload_events_.size() + 2);
+		queue_.enqueueWriteBuffer(image_data_buffer, CL_FALSE, 0, sizeof(image_data_), image_data_, NULL, &upload_events_[upload_events_.size() - 2]);
+		queue_.enqueueFillBuffer(histogram_buffer, 0, 0, HISTOGRAM_SIZE, NULL, &upload_events_.back());
+
+		// 2. Enqueue kernels, each waiting on the stage before it
+		histogram_events_.clear();
+		enqueue_histogram(cache_, queue_, input_image_buffer, histogram_buffer, image_data_buffer, bin_count, channels, pixel_count, &upload_events_, histogram_events_, pixels_per_item_, layout_);
+		scan_events_.clear();
+		enqueue_scan(cache_, queue_, histogram_buffer, cumulative_histogram_buffer, bin_count, channels, cache_.wait_list("scan", histogram_events_.back()), scan_events_);
+		enqueue_lookup_table(cache_, queue_, cumulative_histogram_buffer, lut_buffer, image_data_buffer, bin_count, channels, cache_.wait_list("lut", scan_events_.back()), lut_event_);
+		enqueue_map<T>(cache_, queue_, input_image_buffer, lut_buffer, output_buffer, image_data_buffer, bin_count, channels, pixel_count, cache_.wait_list("map", lut_event_), map_event_, layout_);
+
+		// 3. Enqueue retrieval of output from device memory straight into the output image
+		queue_.enqueueReadBuffer(output_buffer, CL_FALSE, 0, IMAGE_SIZE, output_data, cache_.wait_list("output", map_event_), &output_event_);
+		queue_.flush(); // Start the device on this image while the host moves on
+		return output_event_;
+	}
+
+	cl::CommandQueue queue_;
+	PipelineCache cache_;
+	int pixels_per_item_;
+	PixelLayout layout_;
+	bool verbose_;
+
+	// State of the last submission
+	int image_data_[4];
+	int tile_data_[3][4];
+	int sequence_bin_count_ = 0, sequence_channel_count_ = 0; // Shape of the frames the running average is of
+	vector<int> segments_;
+	vector<T> packed_;
+	vector<cl::Event> upload_events_, convert_events_, histogram_events_, scan_events_;
+	cl::Event lut_event_, map_event_, output_event_;
+	const char* lut_role_ = "lut"; // Buffer and size of the last lookup table, see lookup_table_buffer()
+	size_t lut_size_ = 0;
+};
+
+// Builds the kernels for pixel type T and runs the selected pipeline(s) over the image into output_image, which is only
+// reallocated when its size differs, so it may share storage of the right size
+template <typename T>
+void equalise(cl::Context& context, cl::CommandQueue& queue, const string& kernel_source, const cimg_library::CImg<T>& image_input, CImg<T>& output_image, const string& mode, int pixels_per_item, PixelLayout layout, size_t max_tile_size) {
+	// 1. Build kernels, or load them from the program cache
+	Equalizer<T> equalizer(context, queue, build_program(context, kernel_source, pixel_build_options<T>()), pixels_per_item, layout);
+
+	// 2. Perform histogram equalisation. Latency is measured on the host, from the first upload to the image being back.
+	// The staged pipeline uses zero-copy transfers on devices that share memory with the host, when both images are in
+	// aligned storage. Compare mode also times the explicit transfers zero-copy saves
+	if (mode == "staged" || mode == "compare") {
+		const bool ZERO_COPY = zero_copy_supported(queue);
+		output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+		const cl_ulong COPY_TRANSFER_NS = ZERO_COPY && mode == "compare" ? copy_transfer_time(context, queue, image_input, output_image) : 0;
+		auto start = chrono::high_resolution_clock::now();
+		equalizer.process_staged(image_input, output_image, ZERO_COPY, COPY_TRANSFER_NS);
+		auto latency = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+		cout << "Staged per-image latency: " << latency.count() << " [us]" << endl;
+	}
+
+	// Images larger than the device's largest allocation cannot be equalised whole, so the fused pipeline tiles them
+	const bool TOO_LARGE = image_input.size() * sizeof(T) > context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	if (mode == "tiled" || (mode == "fused" && TOO_LARGE))
+		equalizer.process_tiled(image_input, output_image, max_tile_size);
+	else if (mode == "fused" || mode == "compare") {
+		auto start = chrono::high_resolution_clock::now();
+		equalizer.process(image_input, output_image);
+		auto latency = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+		cout << "Fused per-image latency: " << latency.count() << " [us]" << endl;
+	}
+}
+
+// Writes an image to a stream as binary PNM, P5 for one channel and P6 for three. The header declares max_value, or
+// when it is 0, the same maximum value CImg would. Samples are interleaved, and 16-bit ones made big-endian, into a
+// block buffer that is written a block at a time. Interleaved (channels, width, height) images are taken as they are,
+// so they need no permute before saving, and 8-bit ones are written straight from the image.
+template <typename T>
+void write_pnm(ostream& out, const CImg<T>& image, PixelLayout layout = LAYOUT_PLANAR, int max_value = 0) {
+	const size_t BLOCK_PIXELS = 1 << 20;
+	const bool INTERLEAVED = layout == LAYOUT_INTERLEAVED;
+	const int CHANNEL_COUNT = INTERLEAVED ? image.width() : image.spectrum();
+	const int WIDTH = INTERLEAVED ? image.height() : image.width();
+	const int HEIGHT = INTERLEAVED ? image.depth() : image.height();
+	const size_t PIXEL_COUNT = (size_t)WIDTH * HEIGHT;
+	if (CHANNEL_COUNT != 1 && CHANNEL_COUNT != 3)
+		throw CImgArgumentException("write_pnm: %d-channel images cannot be written as PNM", CHANNEL_COUNT);
+
+	// 1. Write the header
+	if (max_value == 0) {
+		const T IMAGE_MAX = image.max();
+		max_value = IMAGE_MAX < 256 ? 255 : IMAGE_MAX < 4096 ? 4095 : 65535;
+	}
+	const int SAMPLE_SIZE = max_value < 256 ? 1 : 2;
+	out << (CHANNEL_COUNT == 1 ? "P5" : "P6") << "\n" << WIDTH << " " << HEIGHT << "\n" << max_value << "\n";
+	if ((INTERLEAVED || CHANNEL_COUNT == 1) && sizeof(T) == 1) {
+		out.write(reinterpret_cast<const char*>(image.data()), image.size());
+		return;
+	}
+
+	// 2. Write the samples a block of pixels at a time
+	vector<unsigned char> block(min(BLOCK_PIXELS, PIXEL_COUNT) * CHANNEL_COUNT * SAMPLE_SIZE);
+	for (size_t first_pixel = 0; first_pixel < PIXEL_COUNT; first_pixel += BLOCK_PIXELS) {
+		const size_t BLOCK_PIXEL_COUNT = min(BLOCK_PIXELS, PIXEL_COUNT - first_pixel);
+		unsigned char* sample = block.data();
+		for (size_t pixel = first_pixel; pixel < first_pixel + BLOCK_PIXEL_COUNT; pixel++)
+			for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+				const T VALUE = INTERLEAVED ? image[(pixel * CHANNEL_COUNT) + channel] : image[pixel + (PIXEL_COUNT * channel)];
+				if (SAMPLE_SIZE == 2)
+					*sample++ = (unsigned char)(VALUE >> 8);
+				*sample++ = (unsigned char)VALUE;
+			}
+		out.write(reinterpret_cast<const char*>(block.data()), sample - block.data());
+	}
+}
+
+template <typename T>
+void write_pnm(const CImg<T>& image, const string& filename, PixelLayout layout = LAYOUT_PLANAR) {
+	ofstream file(filename, ios::binary);
+	if (!file)
+		throw CImgIOException("write_pnm: cannot open file '%s'", filename.c_str());
+	write_pnm(file, image, layout);
+	if (!file)
+		throw CImgIOException("write_pnm: cannot write file '%s'", filename.c_str());
+}
+
+// Saves the result of a headless run and reports how long encoding took
+template <typename T>
+void save_output(const CImg<T>& output_image, const string& output_file, PixelLayout layout) {
+	auto start = chrono::high_resolution_clock::now();
+	write_pnm(output_image, output_file, layout);
+	auto latency = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+	cout << "Saved " << output_file << " in " << latency.count() << " [us]" << endl;
+}
+
+// Shows the input and output images side by side until the input window is closed. The host sleeps until either window
+// has an event rather than polling them.
+template <typename T>
+void display(const CImg<T>& image_input, const CImg<T>& output_image) {
+#if cimg_display == 0
+	cout << "Built without display support, use -o to save the equalised image" << endl;
+#else
+	CImgDisplay disp_input(image_input, "input");
+	CImgDisplay disp_output(output_image, "output");
+
+	while (!disp_input.is_closed()
+		&& !disp_input.is_keyESC())
+		CImgDisplay::wait(disp_input, disp_output);
+#endif
+}
+
+// Equalises the image and shows the input and output side by side until the input window is closed, or with
+// output_file set, saves the output instead. With interleaved set, the image is first converted to an interleaved frame
+// to exercise the same path as interleaved producers. The image is equalised into aligned_output when one is given.
+template <typename T>
+void equalise_and_display(cl::Context& context, cl::CommandQueue& queue, const string& kernel_source, const cimg_library::CImg<T>& image_input, const string& mode, int pixels_per_item, bool interleaved, size_t max_tile_size, const string& output_file, CImg<T>* aligned_output = NULL) {
+	CImg<T> owned_output;
+	CImg<T>& output_image = aligned_output ? *aligned_output : owned_output;
+	if (interleaved)
+		equalise(context, queue, kernel_source, image_input.get_permute_axes("cxyz"), output_image, mode, pixels_per_item, LAYOUT_INTERLEAVED, max_tile_size);
+	else
+		equalise(context, queue, kernel_source, image_input, output_image, mode, pixels_per_item, LAYOUT_PLANAR, max_tile_size);
+
+	if (!output_file.empty())
+		save_output(output_image, output_file, interleaved ? LAYOUT_INTERLEAVED : LAYOUT_PLANAR);
+	else
+		display(image_input, interleaved ? output_image.permute_axes("yzcx") : output_image);
+}
+
+// Decodes a PNM file and equalises it like equalise_and_display(). For the staged pipeline on zero-copy devices, a binary
+// PNM file is decoded straight into aligned storage, as CImg decodes in place into an image that already has the file's
+// size, and equalised into aligned storage too, so the images are neither copied into nor out of it. Other files are
+// decoded into CImg's own storage and transferred explicitly.
+template <typename T>
+void load_equalise_and_display(cl::Context& context, cl::CommandQueue& queue, const string& kernel_source, const string& filename, const string& mode, int pixels_per_item, bool interleaved, size_t max_tile_size, const string& output_file) {
+	PnmHeader header;
+	bool aligned = (mode == "staged" || mode == "compare") && !interleaved && zero_copy_supported(queue);
+	if (aligned) {
+		ifstream file(filename, ios::binary);
+		try {
+			aligned = read_pnm_header(file, header);
+		}
+		catch (CImgIOException&) {
+			aligned = false; // Not binary, e.g. an ASCII PNM
+		}
+	}
+	if (!aligned) {
+		equalise_and_display(context, queue, kernel_source, CImg<T>(filename.c_str()), mode, pixels_per_item, interleaved, max_tile_size, output_file);
+		return;
+	}
+	AlignedImage<T> image_input(queue, header.width, header.height, 1, header.channels);
+	AlignedImage<T> output_image(queue, header.width, header.height, 1, header.channels);
+	image_input.image().load_pnm(filename.c_str());
+	equalise_and_display(context, queue, kernel_source, image_input.image(), mode, pixels_per_item, interleaved, max_tile_size, output_file, &output_image.image());
+}
+
+// Equalises a binary PNM file straight from a memory map with the fused pipeline, then shows the input and output side
+// by side, or with output_file set, saves the output. The input is only decoded for display, after the equalisation has
+// been timed.
+template <typename T>
+void equalise_mapped_and_display(cl::Context& context, cl::CommandQueue& queue, const string& kernel_source, const string& filename, int pixels_per_item, const string& output_file) {
+	// 1. Map the file and build kernels, or load them from the program cache
+	PnmFile file(filename);
+	Equalizer<T> equalizer(context, queue, build_program(context, kernel_source, pixel_build_options<T>()), pixels_per_item, LAYOUT_INTERLEAVED);
+
+	// 2. Perform histogram equalisation, measuring latency on the host from the upload to the image being back
+	CImg<T> output_image;
+	auto start = chrono::high_resolution_clock::now();
+	equalizer.process(file, output_image);
+	auto latency = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+	cout << "Mapped per-image latency: " << latency.count() << " [us]" << endl;
+
+	// 3. Save the output as it is, or show both images as planar
+	if (!output_file.empty()) {
+		save_output(output_image, output_file, LAYOUT_INTERLEAVED);
+		return;
+	}
+	CImg<T> image_input(reinterpret_cast<const T*>(file.pixels()), file.channels(), file.width(), file.height());
+	if (sizeof(T) > 1)
+		image_input.invert_endianness();
+	display(image_input.permute_axes("yzcx"), output_image.permute_axes("yzcx"));
 }
 
+// Reads the maximum sample value from a PNM (P1-P6) header without decoding any pixels, so the pixel type can be
+// chosen before the image is loaded. Returns -1 for files that are not PNM.
+int pnm_max_value(const string& filename) {
+	ifstream file(filename, ios::binary);
+	char magic[2] = {};
+	if (!file.read(magic, 2) || magic[0] != 'P' || magic[1] < '1' || magic[1] > '6')
+		return -1;
+	if (magic[1] == '1' || magic[1] == '4')
+		return 1; // Bitmaps have no maximum value field
+
+	// 1. Read width, height and maximum value, skipping whitespace and comments between them
+	int fields[3] = {};
+	for (int& field : fields) {
+		while (file >> ws && file.peek() == '#')
+			file.ignore(numeric_limits<streamsize>::max(), '\n');
+		if (!(file >> field))
+			return -1;
+	}
+	return fields[2];
+}
+
+// Batch processing. Images are equalised by BATCH_SLOTS engines that share one program but each have their own queue
+// and buffers, and are used in rotation. Before a slot takes its next image, the host waits for the slot's previous image
+// to download and encodes it, so image N+1 is decoded and uploaded while image N computes and image N-1 is downloaded.
+// With pack_size above 1, images are instead collected pack_size at a time and equalised with Equalizer::process_batch,
+// which suits small images whose launch and transfer overheads outweigh their compute.
+const int BATCH_SLOTS = 3;
+
+template <typename T>
+class BatchRunner {
+public:
+	BatchRunner(cl::Context& context, const string& kernel_source, int pixels_per_item, const string& output_dir, int pack_size = 1)
+		: output_dir_(output_dir), pack_size_(pack_size) {
+		cl::Program program = build_program(context, kernel_source, pixel_build_options<T>());
+		for (Slot& slot : slots_) {
+			slot.queue = cl::CommandQueue(context);
+			slot.equalizer.reset(new Equalizer<T>(context, slot.queue, program, pixels_per_item, LAYOUT_PLANAR, false));
+		}
+	}
+
+	// Decodes an image into the next slot and submits it, without waiting for it to be equalised. An image that cannot
+	// be decoded or submitted is reported and skipped, so one bad file does not end the batch.
+	void push(const string& filename) {
+		if (pack_size_ > 1) {
+			pack_inputs_.resize(pack_size_);
+			pack_files_.resize(pack_size_);
+			if (!load(pack_inputs_[pack_count_], filename))
+				return;
+			pack_files_[pack_count_] = filename;
+			image_count_++;
+			byte_count_ += pack_inputs_[pack_count_].size() * sizeof(T);
+			if (++pack_count_ == pack_size_)
+				finish_pack();
+			return;
+		}
+		Slot& slot = slots_[next_slot_];
+		next_slot_ = (next_slot_ + 1) % BATCH_SLOTS;
+		finish(slot);
+		if (!load(slot.input, filename))
+			return;
+		slot.filename = filename;
+		try {
+			slot.done = slot.equalizer->submit(slot.input, slot.output);
+		}
+		catch (const cl::Error& err) {
+			cout << "Skipping " << filename << ": " << err.what() << ", " << getErrorString(err.err()) << endl;
+			skipped_count_++;
+			return;
+		}
+		catch (const CImgException& err) {
+			cout << "Skipping " << filename << ": " << err.what() << endl; // E.g. too many pixels for the kernels
+			skipped_count_++;
+			return;
+		}
+		slot.busy = true;
+		image_count_++;
+		byte_count_ += slot.input.size() * sizeof(T);
+	}
+
+	// Finishes every image still in flight
+	void drain() {
+		for (Slot& slot : slots_)
+			finish(slot);
+		if (pack_count_ > 0) {
+			pack_inputs_.resize(pack_count_);
+			finish_pack();
+		}
+	}
+
+	int image_count() const { return image_count_; }
+	int skipped_count() const { return skipped_count_; }
+	size_t byte_count() const { return byte_count_; }
+
+private:
+	struct Slot {
+		cl::CommandQueue queue;
+		unique_ptr<Equalizer<T>> equalizer;
+		CImg<T> input, output;
+		string filename;
+		cl::Event done;
+		bool busy = false;
+	};
+
+	void finish(Slot& slot) {
+		if (!slot.busy)
+			return;
+		slot.done.wait();
+		slot.busy = false;
+		save(slot.output, slot.filename);
+	}
+
+	void finish_pack() {
+		try {
+			slots_[0].equalizer->process_batch(pack_inputs_, pack_outputs_);
+			for (int i = 0; i < pack_count_; i++)
+				save(pack_outputs_[i], pack_files_[i]);
+		}
+		catch (const cl::Error& err) {
+			cout << "Skipping a pack of " << pack_count_ << " images: " << err.what() << ", " << getErrorString(err.err()) << endl;
+			skip_pack();
+		}
+		catch (const CImgException& err) {
+			cout << "Skipping a pack of " << pack_count_ << " images: " << err.what() << endl;
+			skip_pack();
+		}
+		pack_count_ = 0;
+	}
+
+	// Counts every image of the current pack as skipped rather than equalised
+	void skip_pack() {
+		skipped_count_ += pack_count_;
+		image_count_ -= pack_count_;
+		for (int i = 0; i < pack_count_; i++)
+			byte_count_ -= pack_inputs_[i].size() * sizeof(T);
+	}
+
+	bool load(CImg<T>& image, const string& filename) {
+		try {
+			image.load(filename.c_str());
+			return true;
+		}
+		catch (const CImgException& err) {
+			cout << "Skipping " << filename << ": " << err.what() << endl;
+			skipped_count_++;
+			return false;
+		}
+	}
+
+	void save(const CImg<T>& image, const string& filename) {
+		if (output_dir_.empty())
+			return;
+		try {
+			write_pnm(image, output_dir_ + "/" + cimg::basename(filename.c_str()));
+		}
+		catch (const CImgException& err) {
+			cout << "Cannot save " << filename << ": " << err.what() << endl;
+			skipped_count_++;
+		}
+	}
+
+	Slot slots_[BATCH_SLOTS];
+	int next_slot_ = 0;
+	string output_dir_;
+	int pack_size_;
+	int pack_count_ = 0;
+	vector<CImg<T>> pack_inputs_, pack_outputs_;
+	vector<string> pack_files_;
+	int image_count_ = 0;
+	int skipped_count_ = 0;
+	size_t byte_count_ = 0;
+};
+
+// Lists a batch from a directory, or from a text file naming one image per line
+vector<string> batch_files(const string& path) {
+	vector<string> files;
+	if (cimg::is_directory(path.c_str())) {
+		CImgList<char> names = cimg::files(path.c_str(), false, 0, true);
+		for (const CImg<char>& name : names)
+			files.push_back(name.data());
+	}
+	else {
+		ifstream list(path);
+		string line;
+		while (getline(list, line))
+			if (!line.empty())
+				files.push_back(line);
+	}
+	return files;
+}
+
+// Equalises every PNM image of a batch through one context, keeping a separate set of slots for 8-bit and 16-bit
+// images, and reports the aggregate throughput. Other files are skipped, since only PNM headers tell the pixel type
+// without decoding the image.
+void run_batch(cl::Context& context, const string& kernel_source, const string& path, const string& output_dir, int pixels_per_item, int pack_size) {
+	unique_ptr<BatchRunner<unsigned char>> runner8;
+	unique_ptr<BatchRunner<unsigned short>> runner16;
+
+	// 1. Push every image through the slots
+	auto start = chrono::high_resolution_clock::now();
+	for (const string& file : batch_files(path)) {
+		const int MAX_VALUE = pnm_max_value(file);
+		if (MAX_VALUE < 0) {
+			cout << "Skipping " << file << ": not a PNM image" << endl;
+			continue;
+		}
+		if (MAX_VALUE > 255) {
+			if (!runner16)
+				runner16.reset(new BatchRunner<unsigned short>(context, kernel_source, pixels_per_item, output_dir, pack_size));
+			runner16->push(file);
+		}
+		else {
+			if (!runner8)
+				runner8.reset(new BatchRunner<unsigned char>(context, kernel_source, pixels_per_item, output_dir, pack_size));
+			runner8->push(file);
+		}
+	}
+	if (runner8)
+		runner8->drain();
+	if (runner16)
+		runner16->drain();
+	const double SECONDS = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+	// 2. Report throughput over the decoded pixel data
+	const int IMAGE_COUNT = (runner8 ? runner8->image_count() : 0) + (runner16 ? runner16->image_count() : 0);
+	const size_t BYTE_COUNT = (runner8 ? runner8->byte_count() : 0) + (runner16 ? runner16->byte_count() : 0);
+	const int SKIPPED_COUNT = (runner8 ? runner8->skipped_count() : 0) + (runner16 ? runner16->skipped_count() : 0);
+	cout << "[ BATCH ]" << endl;
+	cout << "Equalised " << IMAGE_COUNT << " images in " << SECONDS << " [s]" << endl;
+	if (SKIPPED_COUNT > 0)
+		cout << "Failed: " << SKIPPED_COUNT << " images" << endl;
+	cout << "Throughput: " << IMAGE_COUNT / SECONDS << " [images/s], " << BYTE_COUNT / SECONDS / 1e6 << " [MB/s]" << endl;
+	if (IMAGE_COUNT > 0)
+		cout << "Amortised per-image latency: " << SECONDS * 1e6 / IMAGE_COUNT << " [us]" << endl;
+}
+
+// Streaming. Concatenated binary PNM frames are read from in and the equalised frames written to out in the same
+// format, through one engine whose program and buffers stay warm across frames. The next frame is read while the device
+// equalises the current one, and the current result is written while the device equalises the next, so reading,
+// computing and writing overlap. Every frame must have the sample size of the first, which selects the pixel type.
+// With smoothing above 0, the frames are equalised as a sequence (see Equalizer::submit_sequence) with that weight.
+template <typename T>
+void stream_frames(cl::Context& context, cl::CommandQueue& queue, const string& kernel_source, int pixels_per_item, float smoothing, istream& in, ostream& out, const PnmHeader& first_header) {
+	Equalizer<T> equalizer(context, queue, build_program(context, kernel_source, pixel_build_options<T>()), pixels_per_item, LAYOUT_INTERLEAVED, false);
+	PnmHeader headers[2] = { first_header, PnmHeader() };
+	vector<unsigned char> payloads[2];
+	CImg<T> output_images[2];
+	int frame_count = 0;
+	size_t byte_count = 0;
+
+	// 1. Submit the first frame
+	auto start = chrono::high_resolution_clock::now();
+	payloads[0].resize(headers[0].size());
+	if (!in.read(reinterpret_cast<char*>(payloads[0].data()), payloads[0].size()))
+		throw CImgIOException("stream_frames: input ends inside frame 0");
+	cl::Event done = (smoothing > 0) ? equalizer.submit_sequence(headers[0], payloads[0].data(), output_images[0], smoothing) : equalizer.submit(headers[0], payloads[0].data(), output_images[0]);
+
+	// 2. Read frame N+1, wait for frame N, submit frame N+1 and write frame N, until the input ends
+	for (int current = 0;; current = 1 - current) {
+		const int NEXT = 1 - current;
+		const bool MORE = read_pnm_header(in, headers[NEXT]);
+		if (MORE) {
+			if (headers[NEXT].sample_size() != (int)sizeof(T))
+				throw CImgIOException("stream_frames: frame %d changes the sample size", frame_count + 1);
+			payloads[NEXT].resize(headers[NEXT].size());
+			if (!in.read(reinterpret_cast<char*>(payloads[NEXT].data()), payloads[NEXT].size()))
+				throw CImgIOException("stream_frames: input ends inside frame %d", frame_count + 1);
+		}
+		done.wait();
+		frame_count++;
+		byte_count += headers[current].size();
+		if (MORE)
+			done = (smoothing > 0) ? equalizer.submit_sequence(headers[NEXT], payloads[NEXT].data(), output_images[NEXT], smoothing) : equalizer.submit(headers[NEXT], payloads[NEXT].data(), output_images[NEXT]);
+		write_pnm(out, output_images[current], LAYOUT_INTERLEAVED, headers[current].max_value);
+		if (!MORE)
+			break;
+	}
+	out.flush();
+	const double SECONDS = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+	// 3. Report the sustained frame rate, from the first frame read to the last frame written
+	cout << "[ STREAM ]" << endl;
+	cout << "Equalised " << frame_count << " frames in " << SECONDS << " [s]" << endl;
+	cout << "Frame rate: " << frame_count / SECONDS << " [frames/s], " << byte_count / SECONDS / 1e6 << " [MB/s]" << endl;
+}
+
+// Equalises the PNM frames on in into out, choosing the pixel type from the first frame
+void run_stream(cl::Context& context, cl::CommandQueue& queue, const string& kernel_source, int pixels_per_item, float smoothing, istream& in, ostream& out) {
+	PnmHeader header;
+	if (!read_pnm_header(in, header))
+		cout << "No frames on standard input" << endl;
+	else if (header.sample_size() > 1)
+		stream_frames<unsigned short>(context, queue, kernel_source, pixels_per_item, smoothing, in, out, header);
+	else
+		stream_frames<unsigned char>(context, queue, kernel_source, pixels_per_item, smoothing, in, out, header);
+}
+
+// The tests (tests/tests.cpp) build this file into an executable of their own, with their own main()
+#ifndef EQUALIZER_NO_MAIN
 int main(int argc, char** argv) {
 	//Part 1 - handle command line options such as device selection, verbosity, etc.
 	int platform_id = 0;
 	int device_id = 0;
-	string image_filename = "mdr16-gs.pgm"; // Valid: test.pgm, test.ppm, test_large.pgm, test_large.ppm, mdr-16.ppm, mdr16-gs.pgm. NOTE: 16-bit images seem to have issues with high-intensity values, but I'm not quite sure why.
+	string mode = "staged";
+	int pixels_per_item = 0;
+	bool interleaved = false;
+	string batch_path;
+	string output_path;
+	int pack_size = 1;
+	string kernels_file;
+	size_t max_tile_size = 0;
+	bool stream = false;
+	float smoothing = 0;
+	bool smoothing_set = false;
+	string image_filename = "mdr16-gs.pgm"; // Valid: test.pgm, test.ppm, test_large.pgm, test_large.ppm, mdr-16.ppm, mdr16-gs.pgm
 
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { mode = argv[++i]; }
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { pixels_per_item = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-i") == 0) { interleaved = true; }
+		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { batch_path = argv[++i]; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_path = argv[++i]; }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { pack_size = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-t") == 0) && (i < (argc - 1))) { max_tile_size = (size_t)(atof(argv[++i]) * 1e6); }
+		else if ((strcmp(argv[i], "--kernels") == 0) && (i < (argc - 1))) { kernels_file = argv[++i]; }
+		else if (strcmp(argv[i], "-s") == 0) { stream = true; }
+		else if ((strcmp(argv[i], "-a") == 0) && (i < (argc - 1))) { smoothing = (float)atof(argv[++i]); smoothing_set = true; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
+	// A weight outside (0, 1] would let the running average diverge, and 0 would never take in a frame
+	if (smoothing_set && !(smoothing > 0 && smoothing <= 1)) {
+		std::cerr << "ERROR: -a takes a smoothing weight in (0, 1]" << std::endl;
+		return 1;
+	}
+
+#if cimg_display == 0
+	// Headless builds cannot show an equalised image, so it must be saved
+	if (output_path.empty() && batch_path.empty() && !stream) {
+		std::cerr << "ERROR: built without display support, use -o to save the equalised image" << std::endl;
+		return 1;
+	}
+#endif
+
+	// Stream mode writes frames to standard output, so everything else printed goes to standard error instead
+	streambuf* frame_buffer = cout.rdbuf();
+	if (stream) {
+		ios::sync_with_stdio(false); // Buffer standard input and output in the streams rather than per call
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		cout.rdbuf(cerr.rdbuf());
+	}
+
+	// Kernels are built from the embedded source unless a file is given, so the executable runs from any directory
+	string kernel_source = KERNEL_SOURCE;
+	if (!kernels_file.empty()) {
+		ifstream kernels_stream(kernels_file);
+		if (!kernels_stream) {
+			std::cerr << "ERROR: cannot open kernel source " << kernels_file << std::endl;
+			return 1;
+		}
+		kernel_source.assign(istreambuf_iterator<char>(kernels_stream), istreambuf_iterator<char>());
+	}
+
 	cimg::exception_mode(0);
 
 	//detect any potential exceptions
 	try {
 		// 1. Setup OpenlCL & CImg
-		CImg<unsigned short> image_query(image_filename.c_str());
-		CImg<unsigned char> image_input(image_filename.c_str());
-		bool bit16 = image_query.max() > 255; // Perform 16-to-8 bit conversion if necessary
-		if (bit16)
-			image_input = image_query.normalize(0, 255);
-
-		CImgDisplay disp_input(image_input, "input");
-
 		cl::Context context = GetContext(platform_id, device_id);
 		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
-		cl::Program::Sources sources;
-		AddSources(sources, "kernels.cl");
-		cl::Program program(context, sources);
 		std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
 
-		// 2. Attempt to build kernels
-		try {
-			program.build();
-		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+		if (stream) {
+			ostream frame_output(frame_buffer);
+			run_stream(context, queue, kernel_source, pixels_per_item, smoothing, cin, frame_output);
+			return 0;
 		}
 
-		// 3. Perform histogram equalisation
-		auto intensity_histogram = create_intensity_histogram(program, context, queue, image_input);
-		auto cumulative_histogram = cumulate_histogram(program, context, queue, intensity_histogram, image_input.spectrum());
-		auto output_image = map_cumulative_histogram_to_image(program, context, queue, image_input, cumulative_histogram);
-
-		// 4. Display output
-		CImgDisplay disp_output(output_image, "output");
-
-		while (!disp_input.is_closed()
-			&& !disp_input.is_keyESC()) {
-			disp_input.wait(1);
-			disp_output.wait(1);
+		if (!batch_path.empty()) {
+			run_batch(context, kernel_source, batch_path, output_path, pixels_per_item, pack_size);
+			return 0;
 		}
 
+		// 2. Equalise 16-bit images natively and everything else as 8-bit. PNM files declare their bit depth in the header,
+		// so they are decoded once, straight into the right pixel type, or in mapped mode not decoded on the host at all
+		const int MAX_VALUE = pnm_max_value(image_filename);
+		if (mode == "mapped" && MAX_VALUE > 255)
+			equalise_mapped_and_display<unsigned short>(context, queue, kernel_source, image_filename, pixels_per_item, output_path);
+		else if (mode == "mapped")
+			equalise_mapped_and_display<unsigned char>(context, queue, kernel_source, image_filename, pixels_per_item, output_path);
+		else if (MAX_VALUE > 255)
+			load_equalise_and_display<unsigned short>(context, queue, kernel_source, image_filename, mode, pixels_per_item, interleaved, max_tile_size, output_path);
+		else if (MAX_VALUE >= 0)
+			load_equalise_and_display<unsigned char>(context, queue, kernel_source, image_filename, mode, pixels_per_item, interleaved, max_tile_size, output_path);
+		else {
+			// Other formats are decoded at 16 bits and narrowed in memory if their values fit in 8
+			CImg<unsigned short> image_input(image_filename.c_str());
+			if (image_input.max() > 255)
+				equalise_and_display(context, queue, kernel_source, image_input, mode, pixels_per_item, interleaved, max_tile_size, output_path);
+			else
+				equalise_and_display(context, queue, kernel_source, CImg<unsigned char>(image_input), mode, pixels_per_item, interleaved, max_tile_size, output_path);
+		}
 	}
 	catch (const cl::Error& err) {
 		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
@@ -193,4 +1886,5 @@ int main(int argc, char** argv) {
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+// Checks of the equalisation engine on synthetic images, run on a real device. They live in an executable of their own
+// because counting host allocations means replacing the global operator new, which the application must not do.
+#include <sstream>
+
+#define EQUALIZER_NO_MAIN
+#include "../main.cpp"
+
+// Host allocation counting. Only allocations made on a thread while it counts are recorded, so those of driver threads
+// running alongside are not.
+thread_local bool counting_allocations = false;
+thread_local size_t allocation_count = 0;
+
+void* operator new(size_t size) {
+	if (counting_allocations)
+		allocation_count++;
+	if (void* memory = malloc(size ? size : 1))
+		return memory;
+	throw bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+	free(memory);
+}
+
+// Number of host allocations the calling thread makes while running test
+template <typename Test>
+size_t count_allocations(Test test) {
+	allocation_count = 0;
+	counting_allocations = true;
+	test();
+	counting_allocations = false;
+	return allocation_count;
+}
+
+bool report(bool passed) {
+	cout << (passed ? "PASSED" : "FAILED") << endl;
+	return passed;
+}
+
+// Header of a binary PGM of the given size, so that a single-channel CImg can be submitted as a mapped payload
+PnmHeader greyscale_header(int width, int height, int max_value) {
+	PnmHeader header;
+	header.width = width;
+	header.height = height;
+	header.channels = 1;
+	header.max_value = max_value;
+	return header;
+}
+
+// Once warmed up on an image, the fused pipeline must equalise it again without allocating on the host, both from a
+// CImg and from a mapped PNM payload. The payload's samples are read as is, so they are declared to span the full range.
+template <typename T>
+bool check_allocations(cl::Context& context, cl::CommandQueue& queue) {
+	// 1. Warm up, filling the buffer pool, the wait lists and the output images
+	Equalizer<T> equalizer(context, queue, 0, LAYOUT_PLANAR, false);
+	CImg<T> image_input(640, 480, 1, 1), output_image, mapped_output_image;
+	image_input.rand(0, numeric_limits<T>::max());
+	const PnmHeader HEADER = greyscale_header(image_input.width(), image_input.height(), numeric_limits<T>::max());
+	const unsigned char* payload = reinterpret_cast<const unsigned char*>(image_input.data());
+	equalizer.process(image_input, output_image);
+	equalizer.submit(HEADER, payload, mapped_output_image).wait();
+
+	// 2. Count the allocations of another run through each path
+	const size_t COUNT = count_allocations([&] { equalizer.process(image_input, output_image); });
+	const size_t MAPPED_COUNT = count_allocations([&] { equalizer.submit(HEADER, payload, mapped_output_image).wait(); });
+
+	// 3. Report
+	cout << "[ ALLOCATIONS, " << sizeof(T) * 8 << "-BIT ]" << endl;
+	cout << "Host allocations per image: " << COUNT << ", mapped: " << MAPPED_COUNT << endl;
+	return report(COUNT == 0 && MAPPED_COUNT == 0);
+}
+
+// Samples above the maximum value a PNM header declares must not index past the histogram or lookup table. The device
+// clamps them to that maximum, so the image must equalise exactly like one clamped on the host.
+template <typename T>
+bool check_out_of_range_samples(cl::Context& context, cl::CommandQueue& queue) {
+	// 1. Equalise an image whose samples span the full range of T, declared with a lower maximum
+	const int MAX_VALUE = sizeof(T) > 1 ? 3000 : 200; // Above 255 for 16-bit samples, which the maximum value selects
+	Equalizer<T> equalizer(context, queue, 0, LAYOUT_PLANAR, false);
+	CImg<T> image_input(640, 480, 1, 1), clamped_input, output_image, clamped_output_image;
+	image_input.rand(0, numeric_limits<T>::max());
+	const PnmHeader HEADER = greyscale_header(image_input.width(), image_input.height(), MAX_VALUE);
+	if (sizeof(T) > 1)
+		image_input.invert_endianness(); // Payloads hold 16-bit samples big-endian
+	equalizer.submit(HEADER, reinterpret_cast<const unsigned char*>(image_input.data()), output_image).wait();
+
+	// 2. Equalise the same image clamped on the host
+	if (sizeof(T) > 1)
+		image_input.invert_endianness();
+	clamped_input = image_input.get_min((T)MAX_VALUE);
+	if (sizeof(T) > 1)
+		clamped_input.invert_endianness();
+	equalizer.submit(HEADER, reinterpret_cast<const unsigned char*>(clamped_input.data()), clamped_output_image).wait();
+
+	// 3. Report
+	cout << "[ OUT-OF-RANGE SAMPLES, " << sizeof(T) * 8 << "-BIT ]" << endl;
+	cout << "Largest sample: " << image_input.max() << ", declared maximum: " << MAX_VALUE << ", largest output: " << output_image.max() << endl;
+	return report(output_image == clamped_output_image && output_image.max() <= MAX_VALUE);
+}
+
+// Runs frames through stream mode, as -s does, and reads back the equalised frames it writes
+vector<CImg<unsigned char>> stream_frames_through(cl::Context& context, cl::CommandQueue& queue, istream& in, float smoothing) {
+	stringstream out;
+	run_stream(context, queue, KERNEL_SOURCE, 0, smoothing, in, out);
+	vector<CImg<unsigned char>> output_frames;
+	PnmHeader header;
+	while (read_pnm_header(out, header)) {
+		output_frames.emplace_back(header.channels, header.width, header.height);
+		out.read(reinterpret_cast<char*>(output_frames.back().data()), header.size());
+	}
+	return output_frames;
+}
+
+// Stream mode must equalise a frame with samples above the maximum value its header declares exactly like the same
+// frame clamped on the host, leaving the frames around it untouched, and write no sample above the maximum. With
+// smoothing above 0 the frames are a sequence, whose running histogram the bad frame must not corrupt for the next.
+bool check_stream_out_of_range_samples(cl::Context& context, cl::CommandQueue& queue, float smoothing) {
+	// 1. Stream an in-range RGB frame, one with samples above its maximum and the first again, then the same three
+	// frames with the middle one clamped on the host
+	const int MAX_VALUE = 100;
+	CImg<unsigned char> frame(3, 320, 240), bad_frame(3, 320, 240); // Interleaved, as stream mode holds frames
+	frame.rand(0, MAX_VALUE);
+	bad_frame.rand(0, 255);
+	CImg<unsigned char> clamped_frame = bad_frame.get_min((unsigned char)MAX_VALUE);
+	stringstream frames, clamped_frames;
+	for (const CImg<unsigned char>* written : { &frame, &bad_frame, &frame })
+		write_pnm(frames, *written, LAYOUT_INTERLEAVED, MAX_VALUE);
+	for (const CImg<unsigned char>* written : { &frame, &clamped_frame, &frame })
+		write_pnm(clamped_frames, *written, LAYOUT_INTERLEAVED, MAX_VALUE);
+	const vector<CImg<unsigned char>> OUTPUT_FRAMES = stream_frames_through(context, queue, frames, smoothing);
+	const vector<CImg<unsigned char>> CLAMPED_OUTPUT_FRAMES = stream_frames_through(context, queue, clamped_frames, smoothing);
+
+	// 2. Report
+	cout << "[ STREAM OUT-OF-RANGE SAMPLES" << (smoothing > 0 ? ", SEQUENCE" : "") << " ]" << endl;
+	bool passed = OUTPUT_FRAMES.size() == 3 && CLAMPED_OUTPUT_FRAMES.size() == 3;
+	for (size_t i = 0; passed && i < OUTPUT_FRAMES.size(); i++) {
+		cout << "Frame " << i << ", largest output: " << (int)OUTPUT_FRAMES[i].max() << ", declared maximum: " << MAX_VALUE << endl;
+		passed = OUTPUT_FRAMES[i] == CLAMPED_OUTPUT_FRAMES[i] && OUTPUT_FRAMES[i].max() <= MAX_VALUE;
+	}
+	return report(passed);
+}
+
+int main(int argc, char** argv) {
+	int platform_id = 0;
+	int device_id = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+		else if (strcmp(argv[i], "-h") == 0) { std::cerr << "Usage: -p platform -d device, -l to list them" << std::endl; return 0; }
+	}
+
+	cimg::exception_mode(0);
+
+	try {
+		cl::Context context = GetContext(platform_id, device_id);
+		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+		std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+
+		int failures = 0;
+		failures += !check_allocations<unsigned char>(context, queue);
+		failures += !check_allocations<unsigned short>(context, queue);
+		failures += !check_out_of_range_samples<unsigned char>(context, queue);
+		failures += !check_out_of_range_samples<unsigned short>(context, queue);
+		failures += !check_stream_out_of_range_samples(context, queue, 0);
+		failures += !check_stream_out_of_range_samples(context, queue, 0.5f);
+		cout << failures << " failed" << endl;
+		return failures ? 1 : 0;
+	}
+	catch (const cl::Error& err) {
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+	}
+	catch (CImgException& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+	}
+	return 1;
+}
@@ -121,13 +121,6 @@ void CheckError(cl_int error) {
 	}
 }
 
-void AddSources(cl::Program::Sources& sources, const string& file_name) {
-	//TODO: add file existence check
-	ifstream file(file_name);
-	string* source_code = new string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
-	sources.push_back((*source_code).c_str());
-}
-
 string ListPlatformsDevices() {
 
 	stringstream sstream;